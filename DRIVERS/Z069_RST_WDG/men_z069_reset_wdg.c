@@ -26,9 +26,41 @@
 
 #include <linux/moduleparam.h>
 #include <linux/miscdevice.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+#include <linux/timekeeping.h>
+#include <linux/atomic.h>
+#include <linux/log2.h>
+#include <linux/sort.h>
 #include <linux/semaphore.h>
 #include <linux/spinlock.h>
 #include <linux/watchdog.h>
+#include <linux/reboot.h>
+#include <linux/jiffies.h>
+#include <linux/timer.h>
+#include <linux/workqueue.h>
+#include <linux/kobject.h>
+#include <linux/device.h>
+#include <linux/capability.h>
+#include <linux/suspend.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/kref.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/pci.h>
+#include <linux/sched.h>
+#include <linux/hardirq.h>
+#include <linux/io.h>
+#include <linux/cpumask.h>
+#include <linux/smp.h>
+#include <linux/delay.h>
+#include <linux/relay.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,15,0)
+#include <linux/sched/isolation.h>
+#endif
 #include <linux/version.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
@@ -56,6 +88,31 @@
 #define Z069_WDTRIG_VAL_AAAA	0xaaaa
 #define WATCHDOG_MINOR 		130
 #define PFX 			"men_z069_reset_wdg: "
+#define Z069_DEBUGFS_DIR	"men_z069_wdg"
+#define Z069_LAT_BUCKETS	24	/**< log2(ns) histogram buckets: 1ns..16ms */
+#define Z069_LAT_CALIB_LOOPS	64	/**< WVR reads during probe calibration */
+#define Z069_COALESCE_PCT_MAX	50	/**< max. coalescing interval [% of timeout] */
+#define Z069_TIMER_SLACK_JIFFIES 3	/**< jiffy rounding of a timer_list expiry */
+#define Z069_GUARD_PCT_MIN	15	/**< min. margin left by a forced trigger [% of timeout] */
+#define Z069_AUTO_WINDOW	128	/**< ping intervals in auto timeout window */
+#define Z069_AUTO_RECALC	(Z069_AUTO_WINDOW / 4) /**< new intervals per recalculation */
+#define Z069_AUTO_MIN_MS	1000	/**< default lower bound of auto timeout */
+#define Z069_MS_PER_COUNT	(1000 / Z069_WDT_TIMER_FREQUENZ)
+#define Z069_AUDIT_MAGIC	0x5a069a0d	/**< valid audit ring header */
+#define Z069_AUDIT_RAM_RECS	256	/**< audit records without reserved memory */
+#define Z069_AUDIT_PRINT	16	/**< records of last boot printed at probe */
+#define Z069_SELFTEST_TIME	1	/**< self-test timeout [1/100s] */
+#define Z069_SELFTEST_WAIT_MS	1000	/**< give up waiting for expiry after this */
+/* Z069_RST_WDG_BIT if it names a single RCR/RMR bit, else none */
+#define Z069_WDG_BIT_DEFAULT \
+	((Z069_RST_WDG_BIT) && (Z069_RST_WDG_BIT) <= 0xffff && \
+	 !((Z069_RST_WDG_BIT) & ((Z069_RST_WDG_BIT) - 1)) ? (Z069_RST_WDG_BIT) : 0)
+#define Z069_TRACE_SUBBUFS	8	/**< sub-buffers per CPU in the trace channel */
+
+/* in-kernel filesystem sync usable by modules, see z069_sync_reset() */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,2,0) && defined(CONFIG_PM_SLEEP)
+# define Z069_HAVE_SYNC_HELPER
+#endif
 #define STR_HELPER(x) 		#x
 #define M_INT_TO_STR(x) 	STR_HELPER(x)
 
@@ -83,6 +140,78 @@ static int device = 0; /**< attach the driver to this Z069 device instance */
 module_param(device, int, S_IRUGO);
 MODULE_PARM_DESC(device, "Attach the driver to this Z069 device instance (default 0 = first detected device)");
 
+static int latency_stats = 0; /**< timestamp every register access */
+module_param(latency_stats, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(latency_stats, "Measure Z069 register access latency, results in debugfs (default 0)");
+
+static int handover_timeout = 0; /**< timeout left armed for the next kernel [s] */
+module_param(handover_timeout, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(handover_timeout, "Timeout [s] the running watchdog is left armed with on kexec/restart and module removal, max. 65 (default 0 = leave unchanged)");
+
+static int coalesce_pct = 0; /**< min. hardware trigger interval [% of timeout] */
+module_param(coalesce_pct, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(coalesce_pct, "Minimum interval between hardware triggers in percent of the timeout, max. " M_INT_TO_STR(Z069_COALESCE_PCT_MAX) " (default 0 = trigger on every ping)");
+
+static int auto_timeout = 0; /**< adapt timeout to observed ping intervals */
+module_param(auto_timeout, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(auto_timeout, "Adapt the timeout to the observed ping intervals (default 0 = off)");
+
+static int auto_min_ms = Z069_AUTO_MIN_MS; /**< lower bound of auto timeout */
+module_param(auto_min_ms, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(auto_min_ms, "Lower bound [ms] of the adapted timeout, min. 2 (default " M_INT_TO_STR(Z069_AUTO_MIN_MS) ")");
+
+static int auto_max_ms = Z069_WDT_COUNTER_MAX * Z069_MS_PER_COUNT; /**< upper bound of auto timeout */
+module_param(auto_max_ms, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(auto_max_ms, "Upper bound [ms] of the adapted timeout (default 65534)");
+
+static int auto_percentile = 99; /**< ping interval percentile the timeout is based on */
+module_param(auto_percentile, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(auto_percentile, "Ping interval percentile the adapted timeout is based on (default 99)");
+
+static int auto_headroom_pct = 100; /**< headroom added to the percentile */
+module_param(auto_headroom_pct, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(auto_headroom_pct, "Headroom [%] added to the ping interval percentile (default 100)");
+
+static int audit = 1; /**< record watchdog events in the audit ring */
+module_param(audit, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(audit, "Record triggers, timer loads and reset controller writes in an audit ring (default 1)");
+
+static unsigned long audit_phys = 0; /**< reserved memory for the audit ring */
+module_param(audit_phys, ulong, S_IRUGO);
+MODULE_PARM_DESC(audit_phys, "Physical address of reserved memory (e.g. memmap=64K$addr) keeping the audit ring over a reset (default 0 = volatile ring)");
+
+static unsigned long audit_size = 0; /**< size of reserved memory */
+module_param(audit_size, ulong, S_IRUGO);
+MODULE_PARM_DESC(audit_size, "Size of the reserved memory at audit_phys");
+
+static char *hk_cpus = NULL; /**< initial housekeeping CPU list */
+module_param(hk_cpus, charp, S_IRUGO);
+MODULE_PARM_DESC(hk_cpus, "CPUs (list, e.g. \"0-1\") for kernel side triggers and timeout checks (default: timer housekeeping CPUs)");
+
+static int selftest = 0; /**< run watchdog self-test after probe */
+module_param(selftest, int, S_IRUGO);
+MODULE_PARM_DESC(selftest, "Test watchdog expiry with masked reset in the background after probe, open() waits for it (default 0)");
+
+static unsigned int wdg_bit = Z069_WDG_BIT_DEFAULT; /**< RCR/RMR bit of the watchdog reset */
+module_param(wdg_bit, uint, S_IRUGO);
+MODULE_PARM_DESC(wdg_bit, "RCR/RMR bit of the watchdog reset, e.g. 0x4, needed by the self-test and RSTIOC_SYNC_RESET (default from Z069_RST_WDG_BIT, 0 = unknown)");
+
+static int trace = 0; /**< write register accesses to the trace channel */
+module_param(trace, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(trace, "Record every register access in the binary trace channel (default 0)");
+
+static int trace_recs = 0; /**< trace records per sub-buffer */
+module_param(trace_recs, int, S_IRUGO);
+MODULE_PARM_DESC(trace_recs, "Records per trace sub-buffer, " M_INT_TO_STR(Z069_TRACE_SUBBUFS) " sub-buffers per CPU (default 0 = no trace channel)");
+
+static int keepalive_defer = 0; /**< let coalesced pings wait for other wakeups */
+module_param(keepalive_defer, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(keepalive_defer, "Forward coalesced pings with a deferrable timer that rides along with other wakeups (default 0)");
+
+static int keepalive_guard_pct = 25; /**< margin left when forcing a deferred trigger */
+module_param(keepalive_guard_pct, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(keepalive_guard_pct, "With keepalive_defer, force the trigger when only this percentage of the timeout is left, " M_INT_TO_STR(Z069_GUARD_PCT_MIN) "..50 (default 25)");
+
 /*
  * about CONFIG_WATCHDOG_NOWAYOUT from menuconfig:
  * The default watchdog behaviour (which you get if you say N here) is
@@ -107,15 +236,76 @@ static int G_defaultTimeout = 0;
 #endif
 
 static struct semaphore G_openSem; /**< allows only one open  */
-static struct semaphore G_wdtLock; /**< locks accesses wdog to regs  */
 
 static int G_expectClose = 0; /**< user has written a "V"  */
-static char *G_wdBase; 	/**< mapped wdog reg base   */
-static u32 G_ioMapped; 	/**< nonzero if Z69 is IO mapped  */
-static u32 G_wdMargin;
+static Z069_UNIT *G_wdUnit;	/**< unit serving /dev/watchdog */
+static LIST_HEAD(G_unitList);	/**< all probed units */
+static DEFINE_MUTEX(G_unitListLock); /**< protects G_unitList */
+static DEFINE_MUTEX(G_clientLock);	/**< kernel client watchdog ops vs. removal */
+static u32 G_wdMargin;		/**< currently loaded timeout in counts */
+static DEFINE_MUTEX(G_loadLock);	/**< serializes timeout loads (WTR, G_wdMargin) */
+static int G_wdAdopted = 0;	/**< watchdog was found running at probe */
+static int G_resetPending = 0;	/**< sync reset running, no more triggers */
 
 static int G_device_cnt = 0; /**< increment this variable after each call of z069_probe */
 
+/** register access latency statistics, one set per direction */
+typedef struct {
+	atomic_long_t hist[Z069_LAT_BUCKETS]; /**< bucket n: [2^n, 2^(n+1)) ns */
+	atomic_long_t count;
+	atomic_long_t sumNs;
+	atomic_long_t maxNs;
+} Z069_LAT_STATS;
+
+static Z069_LAT_STATS G_latRead;	/**< Z69READ_D16() latencies */
+static Z069_LAT_STATS G_latWrite;	/**< Z69WRITE_D16() latencies */
+static struct rchan *G_traceChan;	/**< register access trace channel */
+static DEFINE_PER_CPU(u32, G_traceSeq);	/**< per CPU trace record sequence */
+static u32 G_latCalib[3];		/**< probe calibration min/median/max [ns] */
+static struct dentry *G_debugfsDir;	/**< debugfs directory of this driver */
+
+static DEFINE_SPINLOCK(G_pingLock);	/**< protects ping timestamps/counters and WVR */
+static struct timer_list G_pingTimer;	/**< forwards a coalesced ping */
+static struct timer_list G_pingDeferTimer; /**< same, deferrable (keepalive_defer) */
+static u64 G_lastPingNs;		/**< last ping from userspace (liveness) */
+static u64 G_lastTrigNs;		/**< last hardware trigger */
+static unsigned long G_pingEarly;	/**< expiry of G_pingDeferTimer [jiffies] */
+static unsigned long G_pingsForwarded;	/**< pings triggering the hardware at once */
+static unsigned long G_pingsCoalesced;	/**< pings absorbed by an earlier trigger */
+static unsigned long G_pingsDeferred;	/**< triggers issued by G_pingTimer */
+static unsigned long G_pingsPiggybacked; /**< triggers issued by G_pingDeferTimer */
+static unsigned long G_pingsForced;	/**< G_pingTimer triggers with keepalive_defer */
+
+static u32 G_autoWin[Z069_AUTO_WINDOW];	/**< ping intervals [us], ring */
+static u32 G_autoSort[Z069_AUTO_WINDOW];	/**< sorted copy, used by G_autoWork only */
+static int G_autoIdx;			/**< next write position in G_autoWin */
+static int G_autoFill;			/**< valid entries in G_autoWin */
+static int G_autoNew;			/**< entries since last recalculation */
+static u32 G_autoPctUs;			/**< last computed percentile [us] */
+static unsigned long G_autoAdjusts;	/**< number of timeout adjustments */
+static struct work_struct G_autoWork;	/**< recalculates the auto timeout */
+
+static struct cpumask *G_hkMask;	/**< CPUs for kernel side activity, RCU protected */
+static DEFINE_MUTEX(G_hkLock);		/**< serializes G_hkMask updates */
+static atomic_t G_hkMisses;		/**< kernel activity seen outside G_hkMask */
+
+static struct work_struct G_selftestWork;	/**< background self-test */
+static char G_selftestResult[64] = "not run";	/**< self-test outcome */
+
+static Z069_AUDIT_HDR *G_auditHdr;	/**< audit ring header, NULL if off */
+static Z069_AUDIT_REC *G_auditRec;	/**< audit ring records, RCU protected */
+static u32 G_auditNrecs;		/**< capacity of the audit ring */
+static atomic_t G_auditSeq;		/**< last sequence number written */
+static int G_auditPersistent;		/**< ring lives in reserved memory */
+static Z069_AUDIT_REC *G_auditPrev;	/**< records of the previous boot */
+static u32 G_auditPrevCnt;		/**< valid entries in G_auditPrev */
+static u16 G_bootResetCause;		/**< RCR as found at probe */
+
+static const char *G_auditEvName[] = {
+	"?", "trigger", "load", "open", "release", "set_mask", "set_cause",
+	"set_request", "sync_reset", "attach", "detach"
+};
+
 /*
  * Prototypes
  */
@@ -126,6 +316,8 @@ static ssize_t z069_write(struct file *file, const char *buf, size_t count, loff
 static long z069_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 static int z069_open(struct inode *inode, struct file *file);
 static int z069_release(struct inode *inode, struct file *file);
+static int z069_reboot_notify(struct notifier_block *nb, unsigned long code, void *unused);
+static void wdt_ping_timers_reload(void);
 
 /*
  * Typedefs
@@ -152,6 +344,10 @@ static CHAMELEON_DRIVER_T G_driver = {
 	.remove 	= z069_remove
 };
 
+static struct notifier_block z069_reboot_nb = {
+	.notifier_call	= z069_reboot_notify,
+};
+
 static struct miscdevice z069_watchdog_miscdev=
 {
 	WATCHDOG_MINOR,
@@ -161,296 +357,1618 @@ static struct miscdevice z069_watchdog_miscdev=
 
 
 /*******************************************************************/
-/** Wrapper to perform 16bit writes to the Z069, depending on
- *  memmapped or iomapped IP cor
+/** Account one register access in the latency statistics
+ *
+ *  \param stats  \IN	statistics of the access direction
+ *  \param ns     \IN	measured access time in ns
  */
-void Z69WRITE_D16(char *base, unsigned int offs, u_int16 val)
+static void z069_lat_account(Z069_LAT_STATS *stats, u64 ns)
 {
-	if(G_ioMapped)
-		outw(val, (unsigned long)(base + offs));
-	else
-		writew(val, (char*)(base + offs));
+	int bucket = ns ? ilog2(ns) : 0;
+	long max;
+
+	if(bucket >= Z069_LAT_BUCKETS)
+		bucket = Z069_LAT_BUCKETS - 1;
+
+	atomic_long_inc(&stats->hist[bucket]);
+	atomic_long_inc(&stats->count);
+	atomic_long_add((long)ns, &stats->sumNs);
+
+	max = atomic_long_read(&stats->maxNs);
+	while((long)ns > max) {
+		long old = atomic_long_cmpxchg(&stats->maxNs, max, (long)ns);
+		if(old == max)
+			break;
+		max = old;
+	}
 }
 
 /*******************************************************************/
-/** Wrapper to perform 16bit reads from the Z069, depending on
- *  memmapped or iomapped IP core
+/** Write one register access to the trace channel
+ *
+ *  The record is reserved in the CPU's relay buffer and the sequence
+ *  number is written last, so an mmap consumer never sees a partially
+ *  written record as valid. Format: Z069_TRACE_REC.
  */
-u_int16 Z69READ_D16(char *base, unsigned int offs)
+static void z069_trace(Z069_UNIT *unit, unsigned int offs, u16 val, u8 dir)
 {
-	u16 retval;
+	Z069_TRACE_REC *rec;
+	struct rchan *chan;
+	unsigned long flags;
+	u64 now = ktime_get_ns();
+	u32 nsec;
+
+	local_irq_save(flags);
+	chan = READ_ONCE(G_traceChan);
+	if(chan && (rec = relay_reserve(chan, sizeof(*rec))) != NULL) {
+		rec->seq = 0;
+		smp_wmb();
+		rec->timeSec = (u32)div_u64_rem(now, NSEC_PER_SEC, &nsec);
+		rec->timeNsec = nsec;
+		rec->pid = in_interrupt() ? 0 : task_pid_nr(current);
+		rec->offs = offs;
+		rec->value = val;
+		rec->cpu = smp_processor_id();
+		rec->dir = dir;
+		rec->unit = unit->instance;
+		smp_wmb();
+		rec->seq = ++(*this_cpu_ptr(&G_traceSeq));
+	}
+	local_irq_restore(flags);
+}
 
-	if(G_ioMapped)
-		retval = inw((unsigned long)(base + offs));
-	else
-		retval = readw((char*)(base + offs));
-	return retval;
+static struct dentry *z069_trace_create_buf_file(const char *filename,
+												 struct dentry *parent,
+												 umode_t mode,
+												 struct rchan_buf *buf,
+												 int *is_global)
+{
+	return debugfs_create_file(filename, mode, parent, buf, &relay_file_operations);
+}
+
+static int z069_trace_remove_buf_file(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
+	return 0;
+}
+
+/* flight recorder: always switch to the next sub-buffer, overwriting old data */
+static int z069_trace_subbuf_start(struct rchan_buf *buf, void *subbuf,
+								   void *prev_subbuf, size_t prev_padding)
+{
+	return 1;
 }
 
+static struct rchan_callbacks z069_trace_cb = {
+	.subbuf_start		= z069_trace_subbuf_start,
+	.create_buf_file	= z069_trace_create_buf_file,
+	.remove_buf_file	= z069_trace_remove_buf_file,
+};
+
 /*******************************************************************/
-/** Trigger the watchdog
+/** Open the trace channel: debugfs men_z069_wdg/trace<cpu>
  *
- *  triggers with the alternating 0xAAAA,0x5555 sequence
+ *  Sub-buffers hold exactly trace_recs records, so there is no
+ *  padding and each per CPU file is a plain ring of Z069_TRACE_REC.
  */
-static void wdt_trigger(void)
+static void z069_trace_init(void)
 {
-	u16 val;
-	val = Z69READ_D16(G_wdBase, Z069_RST_WVR);
-	Z069DBG("wdt_trigger: Z069_RST_WVR = 0x%04x\n", val);
-	Z69WRITE_D16(G_wdBase, Z069_RST_WVR, val ^ 0xffff);
+	struct rchan *chan;
+
+	if(trace_recs <= 0 || IS_ERR_OR_NULL(G_debugfsDir))
+		return;
+
+	chan = relay_open("trace", G_debugfsDir, trace_recs * sizeof(Z069_TRACE_REC),
+					  Z069_TRACE_SUBBUFS, &z069_trace_cb, NULL);
+	if(!chan) {
+		printk(KERN_ERR PFX "cannot open trace channel\n");
+		return;
+	}
+	WRITE_ONCE(G_traceChan, chan);
+}
+
+static void z069_trace_exit(void)
+{
+	struct rchan *chan = G_traceChan;
+
+	if(!chan)
+		return;
+
+	WRITE_ONCE(G_traceChan, NULL);
+	/* z069_trace() runs with interrupts disabled */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,20,0)
+	synchronize_sched();
+#else
+	synchronize_rcu();
+#endif
+	relay_close(chan);
 }
 
 /*******************************************************************/
-/** Compute timer value for time
- *
- *  \param  time  \IN	Value in 1/100s
+/** Wrapper to perform 16bit writes to the Z069, depending on
+ *  memmapped or iomapped IP cor
  *
- *  \return val   \OUT  Raw counter value or negative Linux error number
+ *  With latency_stats set the access is timestamped. Note that
+ *  memmapped writes are posted, so this measures the time until
+ *  the CPU accepted the write, not until it reached the FPGA.
  */
-static int wdt_time2val(int time)
+void Z69WRITE_D16(Z069_UNIT *unit, unsigned int offs, u_int16 val)
 {
-	int val = time * Z069_WDT_TIMER_FREQUENZ / 100;
+	u64 t0 = 0;
 
-	if(time != ((val * 100) / Z069_WDT_TIMER_FREQUENZ)) {
-		return -EINVAL; /* value overflow */
-	}
+	if(latency_stats)
+		t0 = ktime_get_ns();
 
-	if((val < Z069_WDT_COUNTER_MIN) || (val > Z069_WDT_COUNTER_MAX))
-		return -EINVAL;
+	if(unit->ioMapped)
+		outw(val, (unsigned long)(unit->base + offs));
+	else
+		writew(val, (char*)(unit->base + offs));
 
-	return val;
+	if(latency_stats)
+		z069_lat_account(&G_latWrite, ktime_get_ns() - t0);
+
+	if(trace)
+		z069_trace(unit, offs, val, Z069_TRACE_WRITE);
 }
 
 /*******************************************************************/
-/** Compute time for watchdog timer value
- *
- *  \param val 	\IN 	In counts of watchdog timer
- *
- *  \return Time in 1/100s
+/** Plain 16bit read from the Z069, without instrumentation
  */
-static int wdt_val2time(int val)
+static inline u16 z069_read_raw(Z069_UNIT *unit, unsigned int offs)
 {
-	return ((val * 100) / Z069_WDT_TIMER_FREQUENZ);
+	if(unit->ioMapped)
+		return inw((unsigned long)(unit->base + offs));
+	else
+		return readw((char*)(unit->base + offs));
 }
 
 /*******************************************************************/
-/** load timeout value into watchdog.
- *
- *  \param time  \IN	Timeout value in 1/100s. 0 means disable watchdog
+/** Wrapper to perform 16bit reads from the Z069, depending on
+ *  memmapped or iomapped IP core
  *
- *  \return The real timeout value in 1/100s or negative Linux error number
+ *  With latency_stats set the access is timestamped. Reads are
+ *  non-posted, so this is the full round trip to the register.
  */
-static int wdt_timer_load(int time)
+u_int16 Z69READ_D16(Z069_UNIT *unit, unsigned int offs)
 {
-	int val;
-
-	Z069DBG("wdt_timer_load %d\n", time);
+	u16 retval;
+	u64 t0 = 0;
 
-	if(time) {
-		if((val = wdt_time2val(time)) < 0)
-			return val;
-	} else
-		val = 0;
+	if(latency_stats)
+		t0 = ktime_get_ns();
 
-	down(&G_wdtLock);
+	retval = z069_read_raw(unit, offs);
 
-	if(val) {
-		Z69WRITE_D16(G_wdBase, Z069_RST_WTR, val | Z069_RST_WTR_WDEN );
-	} else {
-		/* disable watchdog */
-		Z69WRITE_D16(G_wdBase, Z069_RST_WTR, (u_int16)~Z069_RST_WTR_WDEN);
-	}
+	if(latency_stats)
+		z069_lat_account(&G_latRead, ktime_get_ns() - t0);
 
-	up(&G_wdtLock);
-	wdt_trigger();
+	if(trace)
+		z069_trace(unit, offs, retval, Z069_TRACE_READ);
 
-	return val;
+	return retval;
 }
 
-static ssize_t z069_write(struct file *file, const char *buf, size_t count, loff_t *ppos)
+static int z069_lat_cmp(const void *a, const void *b)
 {
-	int i=0;
-	Z069DBG("z069_write:\n");
-
-	if (count) {
-		if (!nowayout) {
-			G_expectClose = 0;
-			for (i = 0; i != count; i++) {
-				char c;
-				if(get_user(c, buf+i))
-					return -EFAULT;
-				if (c == 'V') {
-					Z069DBG("got 'V'\n");
-					G_expectClose = 1;
-				}
-			}
-		}
-		wdt_trigger();
-	}
-	return count;
-}
+	u32 x = *(const u32 *)a;
+	u32 y = *(const u32 *)b;
 
-static ssize_t z069_read(struct file *file, char *buf, size_t count,
-		loff_t *ptr)
-{
-	return -EINVAL;
+	return (x > y) - (x < y);
 }
 
 /*******************************************************************/
-/** z069_SetResetMask:
- *	\param value \IN    value to be set to reset mask register
+/** Calibrate the register path latency
  *
- *	\return always 0
+ *  Reads Z069_RST_WVR a few times and keeps min/median/max as
+ *  reference for the running histogram. Reading WVR has no side
+ *  effects on the watchdog. The reads bypass Z69READ_D16(), so neither
+ *  the instrumentation overhead nor the calibration reads end up in
+ *  the statistics or the trace.
  */
-int z069_SetResetMask(u_int32 value)
+static void z069_lat_calibrate(void)
 {
-	Z069DBG("Z069_SetResetMask := 0x%08x\n", value);
-	Z69WRITE_D16(G_wdBase, Z069_RST_RMR, value);
-	return 0;
+	u32 samples[Z069_LAT_CALIB_LOOPS];
+	u64 t0;
+	int i;
+
+	for(i = 0; i < Z069_LAT_CALIB_LOOPS; i++) {
+		t0 = ktime_get_ns();
+		z069_read_raw(G_wdUnit, Z069_RST_WVR);
+		samples[i] = (u32)min_t(u64, ktime_get_ns() - t0, U32_MAX);
+	}
+	sort(samples, Z069_LAT_CALIB_LOOPS, sizeof(u32), z069_lat_cmp, NULL);
+
+	G_latCalib[0] = samples[0];
+	G_latCalib[1] = samples[Z069_LAT_CALIB_LOOPS / 2];
+	G_latCalib[2] = samples[Z069_LAT_CALIB_LOOPS - 1];
+
+	printk(KERN_INFO PFX "WVR read latency min/median/max = %u/%u/%u ns\n",
+		   G_latCalib[0], G_latCalib[1], G_latCalib[2]);
 }
 
-/*******************************************************************/
-/**	Z069_GetResetMask:
- *	\param value \OUT    read value from reset mask register
- *
- *	\return always 0
- */
-int z069_GetResetMask(u_int32 *value)
+static void z069_lat_show_stats(struct seq_file *m, const char *name,
+								Z069_LAT_STATS *stats)
 {
-	int retVal=Z69READ_D16(G_wdBase, Z069_RST_RMR);
-	Z069DBG("Z069_GetResetMask := 0x%08x\n", retVal);
-	*value = retVal;
-	return 0;
+	long count = atomic_long_read(&stats->count);
+	int i;
+
+	seq_printf(m, "%s: count %ld avg %ld ns max %ld ns\n", name, count,
+			   count ? atomic_long_read(&stats->sumNs) / count : 0,
+			   atomic_long_read(&stats->maxNs));
+	for(i = 0; i < Z069_LAT_BUCKETS; i++) {
+		long n = atomic_long_read(&stats->hist[i]);
+		if(n)
+			seq_printf(m, "  >= %8lu ns: %ld\n", 1UL << i, n);
+	}
 }
 
-/*******************************************************************/
-/** z069_SetResetCause:
- *	\param value \IN    value to be set to reset cause register
- *
- *	\return always 0
- */
-int z069_SetResetCause(u_int32 value)
+static int z069_lat_show(struct seq_file *m, void *v)
 {
-	Z069DBG("Z069_SetResetCause := 0x%08x\n", value);
-	Z69WRITE_D16(G_wdBase, Z069_RST_RCR, value);
+	seq_printf(m, "calibration (WVR read): min %u median %u max %u ns\n",
+			   G_latCalib[0], G_latCalib[1], G_latCalib[2]);
+	z069_lat_show_stats(m, "read", &G_latRead);
+	z069_lat_show_stats(m, "write", &G_latWrite);
 	return 0;
 }
 
-/*******************************************************************/
-/** z069_GetResetCause:
- *	\param value \OUT    value to be set to reset cause register
- *
- *	\return always 0
- */
-int z069_GetResetCause(u_int32 *value)
+static int z069_lat_open(struct inode *inode, struct file *file)
 {
-	int retVal = Z69READ_D16(G_wdBase, Z069_RST_RCR);
-	Z069DBG("Z069_GetResetCause := 0x%08x\n", retVal);
-	*value = retVal;
-	return 0;
+	return single_open(file, z069_lat_show, NULL);
 }
 
+static const struct file_operations z069_lat_fops = {
+	.owner		= THIS_MODULE,
+	.open		= z069_lat_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 /*******************************************************************/
-/** z069_SetResetRequest:
- *	\param value \IN    value to be set to reset request register
+/** Record an event in the audit ring
  *
- *	\return always 0
+ *  Lock free: a slot is claimed by an atomic sequence number and the
+ *  sequence number is written last, so a record torn by a reset is
+ *  recognized and skipped on the next boot. The ring is accessed in an
+ *  RCU read side section, z069_audit_exit() waits for it.
+ *
+ *  \param event  \IN	Z069_AUDIT_xxx
+ *  \param value  \IN	event specific value
  */
-int z069_SetResetRequest(u_int32 value)
+static void z069_audit(u16 event, u16 value)
 {
-	Z069DBG("Z069_SetResetRequest := 0x%08x\n", value);
-	Z69WRITE_D16(G_wdBase, Z069_RST_RRR, value);
-	return 0;
+	Z069_AUDIT_REC *ring, *rec;
+	u64 now, elapsed;
+	u32 seq;
+
+	if(!audit)
+		return;
+
+	rcu_read_lock();
+	ring = rcu_dereference(G_auditRec);
+	if(!ring) {
+		rcu_read_unlock();
+		return;
+	}
+
+	seq = (u32)atomic_inc_return(&G_auditSeq);
+	rec = &ring[(seq - 1) % G_auditNrecs];
+
+	rec->seq = 0;
+	wmb();
+	now = ktime_get_ns();
+	rec->timeNs = ktime_get_real_ns();
+	rec->event = event;
+	rec->value = value;
+	if(G_wdMargin) {
+		elapsed = div_u64(now - G_lastTrigNs, NSEC_PER_MSEC);
+		rec->slackMs = (s32)G_wdMargin * Z069_MS_PER_COUNT - (s32)min_t(u64, elapsed, S32_MAX / 2);
+	} else {
+		rec->slackMs = S32_MAX; /* watchdog not armed */
+	}
+	if(in_interrupt()) {
+		rec->pid = 0;
+		strncpy(rec->comm, "<irq>", sizeof(rec->comm));
+	} else {
+		rec->pid = task_pid_nr(current);
+		memcpy(rec->comm, current->comm, sizeof(rec->comm));
+	}
+	wmb();
+	rec->seq = seq;
+	rcu_read_unlock();
+}
+
+static void z069_audit_show_rec(struct seq_file *m, Z069_AUDIT_REC *rec)
+{
+	u32 nsec;
+	u64 sec = div_u64_rem(rec->timeNs, NSEC_PER_SEC, &nsec);
+	const char *ev = rec->event < ARRAY_SIZE(G_auditEvName) ?
+		G_auditEvName[rec->event] : "?";
+	char slack[16];
+
+	if(rec->slackMs == S32_MAX)
+		strcpy(slack, "-");
+	else
+		snprintf(slack, sizeof(slack), "%d", rec->slackMs);
+
+	if(m)
+		seq_printf(m, "%u %llu.%09u %-11s 0x%04x %5u %-16.16s slack %s ms\n",
+				   rec->seq, (unsigned long long)sec, nsec, ev, rec->value,
+				   rec->pid, rec->comm, slack);
+	else
+		printk(KERN_INFO PFX "  %u %llu.%09u %s 0x%04x pid %u %.16s slack %s ms\n",
+			   rec->seq, (unsigned long long)sec, nsec, ev, rec->value,
+			   rec->pid, rec->comm, slack);
 }
 
 /*******************************************************************/
-/** z069_GetResetRequest:
- *	\param value \IN    value to be set to reset request register
+/** Copy the valid records of a ring in sequence order
  *
- *	\return always 0
+ *  \return number of records copied to dst
  */
-int z069_GetResetRequest(u_int32 *value)
+static u32 z069_audit_collect(Z069_AUDIT_REC *dst, Z069_AUDIT_REC *ring, u32 n)
 {
-	int retVal = Z69READ_D16(G_wdBase, Z069_RST_RRR);
-	Z069DBG("Z069_GetResetRequest := 0x%08x\n", retVal);
-	*value = retVal;
-	return 0;
+	u32 i, seq, maxSeq = 0, cnt = 0;
+
+	for(i = 0; i < n; i++)
+		maxSeq = max(maxSeq, ring[i].seq);
+
+	seq = maxSeq > n ? maxSeq - n + 1 : 1;
+	for(; maxSeq && seq <= maxSeq; seq++) {
+		Z069_AUDIT_REC *rec = &ring[(seq - 1) % n];
+		if(rec->seq == seq)
+			dst[cnt++] = *rec;
+	}
+	return cnt;
 }
 
 /*******************************************************************/
-/** file ops: open the device
- *
- * The watchdog device is single open and on opening we activate
- * the watchdog with its default value.
+/** Set up the audit ring and report the previous boot's trail
  *
+ *  With audit_phys/audit_size the ring is placed in reserved memory,
+ *  mapped uncached so records are not lost in the CPU caches when the
+ *  watchdog resets the board.
+ *  If it holds a valid ring from before the last reset, its records
+ *  are kept for debugfs (audit_prev) and the newest ones are logged
+ *  together with the reset cause latched in RCR.
  */
-static int z069_open(struct inode *inode, struct file *file)
+static void z069_audit_init(Z069_UNIT *unit)
 {
-	u_int16 maskReg = 0;
-
-	Z069DBG("z069_open\n");
+	void *mem = NULL;
+	u32 n;
 
-	if(down_trylock(&G_openSem))
-		return -EBUSY;
-
-	/* now activate watchdog with default timeout */
-	if(wdt_timer_load(G_defaultTimeout) < 0)
-		wdt_timer_load(wdt_val2time( Z069_WDT_COUNTER_MAX));
+	G_bootResetCause = Z69READ_D16(unit, Z069_RST_RCR);
+	printk(KERN_INFO PFX "reset cause RCR = 0x%04x\n", G_bootResetCause);
 
-	/* init WD trigger value register */
-	Z69WRITE_D16(G_wdBase, Z069_RST_WVR, Z069_WDTRIG_VAL_AAAA);
+	if(!audit)
+		return;
 
-	maskReg = Z69READ_D16(G_wdBase, Z069_RST_RMR);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
+	if(audit_phys && audit_size > sizeof(Z069_AUDIT_HDR) + sizeof(Z069_AUDIT_REC)) {
+		/* write-combined like ramoops: nothing may linger in the caches on reset */
+		mem = memremap(audit_phys, audit_size, MEMREMAP_WC);
+		if(!mem)
+			printk(KERN_ERR PFX "cannot map audit memory @ 0x%lx\n", audit_phys);
+	}
+#endif
+	if(mem) {
+		G_auditPersistent = 1;
+		n = (audit_size - sizeof(Z069_AUDIT_HDR)) / sizeof(Z069_AUDIT_REC);
+	} else {
+		n = Z069_AUDIT_RAM_RECS;
+		mem = kzalloc(sizeof(Z069_AUDIT_HDR) + n * sizeof(Z069_AUDIT_REC), GFP_KERNEL);
+		if(!mem)
+			return;
+	}
 
-	/* set Reset mask Register, considering the Z069_RST_WDG_BIT */
-	Z69WRITE_D16(G_wdBase, Z069_RST_RMR, maskReg & ~Z069_RST_WDG_BIT);
+	G_auditHdr = mem;
 
-	wdt_trigger();
-	G_expectClose = 0;
+	if(G_auditPersistent && G_auditHdr->magic == Z069_AUDIT_MAGIC &&
+	   G_auditHdr->nrecs == n && G_auditHdr->recSize == sizeof(Z069_AUDIT_REC) &&
+	   (G_auditPrev = vmalloc(n * sizeof(Z069_AUDIT_REC))) != NULL) {
+		u32 i;
 
-	return 0;
+		G_auditPrevCnt = z069_audit_collect(G_auditPrev, (Z069_AUDIT_REC *)(G_auditHdr + 1), n);
+		printk(KERN_INFO PFX "audit trail before last reset (RCR 0x%04x), last %u of %u:\n",
+			   G_bootResetCause, min_t(u32, G_auditPrevCnt, Z069_AUDIT_PRINT), G_auditPrevCnt);
+		i = G_auditPrevCnt > Z069_AUDIT_PRINT ? G_auditPrevCnt - Z069_AUDIT_PRINT : 0;
+		for(; i < G_auditPrevCnt; i++)
+			z069_audit_show_rec(NULL, &G_auditPrev[i]);
+	}
 
+	memset(G_auditHdr + 1, 0, n * sizeof(Z069_AUDIT_REC));
+	G_auditHdr->magic = Z069_AUDIT_MAGIC;
+	G_auditHdr->nrecs = n;
+	G_auditHdr->recSize = sizeof(Z069_AUDIT_REC);
+	G_auditNrecs = n;
+	atomic_set(&G_auditSeq, 0);
+	rcu_assign_pointer(G_auditRec, (Z069_AUDIT_REC *)(G_auditHdr + 1));
 }
 
-/*******************************************************************/
-/** file ops: release the device
- *
- */
-static int z069_release(struct inode *inode, struct file *file)
+static void z069_audit_exit(void)
 {
-	if(down_trylock(&G_openSem))
-		return -EBUSY;
+	void *mem = G_auditHdr;
 
-	Z069DBG("z069_release\n");
+	if(!mem)
+		return;
 
-	if(G_expectClose) {
-		wdt_timer_load(0); /* disable wdog */
-	} else {
-		printk(KERN_DEBUG PFX "Unexpected close, not stopping timer!\n");
-		wdt_trigger();
+	/* kernel clients of other units may still be in z069_audit() */
+	RCU_INIT_POINTER(G_auditRec, NULL);
+	synchronize_rcu();
+	G_auditHdr = NULL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
+	if(G_auditPersistent)
+		memunmap(mem);
+	else
+#endif
+		kfree(mem);
+	vfree(G_auditPrev);
+	G_auditPrev = NULL;
+}
+
+static int z069_audit_show(struct seq_file *m, void *v)
+{
+	Z069_AUDIT_REC *buf;
+	u32 i, cnt;
+
+	if(m->private) {
+		seq_printf(m, "reset cause 0x%04x\n", G_bootResetCause);
+		for(i = 0; i < G_auditPrevCnt; i++)
+			z069_audit_show_rec(m, &G_auditPrev[i]);
+		return 0;
 	}
-	up(&G_openSem);
+
+	if(!G_auditRec)
+		return 0;
+	if((buf = vmalloc(G_auditNrecs * sizeof(Z069_AUDIT_REC))) == NULL)
+		return -ENOMEM;
+	cnt = z069_audit_collect(buf, G_auditRec, G_auditNrecs);
+	seq_printf(m, "%s ring, %u records\n", G_auditPersistent ? "persistent" : "volatile", cnt);
+	for(i = 0; i < cnt; i++)
+		z069_audit_show_rec(m, &buf[i]);
+	vfree(buf);
 	return 0;
 }
 
-static const struct watchdog_info z069_wdt_info = {
-	.options = WDIOF_SETTIMEOUT | WDIOF_KEEPALIVEPING | WDIOF_MAGICCLOSE,
-	.identity = "Z069 WDT",
-	.firmware_version = 1,
-};
+static int z069_audit_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, z069_audit_show, inode->i_private);
+}
 
+static const struct file_operations z069_audit_fops = {
+	.owner		= THIS_MODULE,
+	.open		= z069_audit_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
 
 /*******************************************************************/
-/** file ops: ioctl handling
+/** Trigger the watchdog
  *
+ *  triggers with the alternating 0xAAAA,0x5555 sequence. Called from
+ *  process context and from the ping timers, so the read/invert/write
+ *  of WVR is done under G_pingLock.
  */
-static long z069_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+static void wdt_trigger(void)
 {
-	int margin;
-	int retVal = 0;
+	u16 val;
 
-	Z069DBG("wdt_ioctl: ");
-	switch(cmd) {
+	spin_lock_bh(&G_pingLock);
+	if(G_resetPending) {
+		spin_unlock_bh(&G_pingLock);
+		return;
+	}
+
+	val = Z69READ_D16(G_wdUnit, Z069_RST_WVR);
+	Z069DBG("wdt_trigger: Z069_RST_WVR = 0x%04x\n", val);
+	Z69WRITE_D16(G_wdUnit, Z069_RST_WVR, val ^ 0xffff);
+	z069_audit(Z069_AUDIT_TRIGGER, val ^ 0xffff);
+	G_lastTrigNs = ktime_get_ns();
+	spin_unlock_bh(&G_pingLock);
+}
+
+/*******************************************************************/
+/** Restart the trigger sequence at 0xAAAA and trigger once
+ */
+static void wdt_trigger_restart(void)
+{
+	spin_lock_bh(&G_pingLock);
+	Z69WRITE_D16(G_wdUnit, Z069_RST_WVR, Z069_WDTRIG_VAL_AAAA);
+	z069_audit(Z069_AUDIT_TRIGGER, Z069_WDTRIG_VAL_AAAA);
+	spin_unlock_bh(&G_pingLock);
+	wdt_trigger();
+}
+
+/*******************************************************************/
+/** Compute timer value for time
+ *
+ *  \param  time  \IN	Value in 1/100s
+ *
+ *  \return val   \OUT  Raw counter value or negative Linux error number
+ */
+static int wdt_time2val(int time)
+{
+	int val = time * Z069_WDT_TIMER_FREQUENZ / 100;
+
+	if(time != ((val * 100) / Z069_WDT_TIMER_FREQUENZ)) {
+		return -EINVAL; /* value overflow */
+	}
+
+	if((val < Z069_WDT_COUNTER_MIN) || (val > Z069_WDT_COUNTER_MAX))
+		return -EINVAL;
+
+	return val;
+}
+
+/*******************************************************************/
+/** Compute time for watchdog timer value
+ *
+ *  \param val 	\IN 	In counts of watchdog timer
+ *
+ *  \return Time in 1/100s
+ */
+static int wdt_val2time(int val)
+{
+	return ((val * 100) / Z069_WDT_TIMER_FREQUENZ);
+}
+
+/*******************************************************************/
+/** Check that the RCR/RMR bit of the watchdog reset is known
+ *
+ *  \return nonzero if wdg_bit is a single bit of the 16 bit registers
+ */
+static int z069_wdg_bit_valid(void)
+{
+	return wdg_bit && wdg_bit <= 0xffff && is_power_of_2(wdg_bit);
+}
+
+/*******************************************************************/
+/** load raw counter value into watchdog, G_loadLock held.
+ *
+ *  Pending ping timers were started for the old timeout and are
+ *  restarted for the new one.
+ *
+ *  \param val  \IN	Counter value. 0 means disable watchdog
+ *
+ *  \return 0 or -EBUSY while a sync reset is pending
+ */
+static int wdt_val_load_locked(int val)
+{
+	if(G_resetPending)
+		return -EBUSY;
+
+	z069_audit(Z069_AUDIT_LOAD, val);
+	down(&G_wdUnit->lock);
+
+	G_wdMargin = val;
+	G_wdAdopted = 0;
+	if(val) {
+		Z69WRITE_D16(G_wdUnit, Z069_RST_WTR, val | Z069_RST_WTR_WDEN );
+	} else {
+		/* disable watchdog */
+		Z69WRITE_D16(G_wdUnit, Z069_RST_WTR, (u_int16)~Z069_RST_WTR_WDEN);
+	}
+
+	up(&G_wdUnit->lock);
+	wdt_trigger();
+	if(val)
+		wdt_ping_timers_reload();
+	return 0;
+}
+
+/*******************************************************************/
+/** load raw counter value into watchdog.
+ *
+ *  Before disabling, the auto timeout work and the ping timers are
+ *  stopped, so they cannot reload or trigger the timer afterwards.
+ *
+ *  \param val  \IN	Counter value. 0 means disable watchdog
+ *
+ *  \return 0 or -EBUSY while a sync reset is pending
+ */
+static int wdt_val_load(int val)
+{
+	int ret;
+
+	if(!val) {
+		cancel_work_sync(&G_autoWork);
+		del_timer_sync(&G_pingDeferTimer);
+		del_timer_sync(&G_pingTimer);
+	}
+
+	mutex_lock(&G_loadLock);
+	ret = wdt_val_load_locked(val);
+	mutex_unlock(&G_loadLock);
+	return ret;
+}
+
+/*******************************************************************/
+/** load timeout value into watchdog.
+ *
+ *  \param time  \IN	Timeout value in 1/100s. 0 means disable watchdog
+ *
+ *  \return The real timeout value in 1/100s or negative Linux error number
+ */
+static int wdt_timer_load(int time)
+{
+	int val;
+
+	int ret;
+
+	Z069DBG("wdt_timer_load %d\n", time);
+
+	if(time) {
+		if((val = wdt_time2val(time)) < 0)
+			return val;
+	} else
+		val = 0;
+
+	if((ret = wdt_val_load(val)) < 0)
+		return ret;
+
+	return val;
+}
+
+/*******************************************************************/
+/** Latest expiry of a timer_list started delay ns ahead
+ *
+ *  Besides the jiffy rounding, the timer wheel batches timers in its
+ *  upper levels and may expire a timer up to 1/8 of its delay late.
+ *
+ *  \param delayNs  \IN	requested delay
+ *
+ *  \return upper bound of the actual delay in ns
+ */
+static u64 wdt_timer_late_ns(u64 delayNs)
+{
+	return delayNs + (delayNs >> 3) + jiffies_to_nsecs(Z069_TIMER_SLACK_JIFFIES);
+}
+
+/*******************************************************************/
+/** Minimum interval between two hardware triggers
+ *
+ *  Coalescing is off if G_pingTimer, started for this interval, could
+ *  expire after the hardware timeout, i.e. for timeouts of only a few
+ *  jiffies.
+ *
+ *  \return interval in ns, 0 if ping coalescing is off
+ */
+static u64 wdt_coalesce_interval(void)
+{
+	int pct = min(coalesce_pct, Z069_COALESCE_PCT_MAX);
+	u64 timeoutNs, interval;
+
+	if(pct <= 0)
+		return 0;
+
+	timeoutNs = div_u64((u64)G_wdMargin * NSEC_PER_SEC, Z069_WDT_TIMER_FREQUENZ);
+	interval = div_u64(timeoutNs * pct, 100);
+	if(wdt_timer_late_ns(interval) >= timeoutNs)
+		return 0;
+
+	return interval;
+}
+
+/*******************************************************************/
+/** Pick a housekeeping CPU for kernel side watchdog activity
+ *
+ *  \return online CPU from G_hkMask, or nr_cpu_ids if there is none
+ */
+static unsigned int z069_hk_cpu(void)
+{
+	struct cpumask *mask;
+	unsigned int cpu = nr_cpu_ids;
+
+	rcu_read_lock();
+	mask = rcu_dereference(G_hkMask);
+	if(mask)
+		cpu = cpumask_any_and(mask, cpu_online_mask);
+	rcu_read_unlock();
+	return cpu;
+}
+
+/*******************************************************************/
+/** Start a timer on a housekeeping CPU
+ *
+ *  The timer must not be pending. Without an online housekeeping CPU
+ *  the timer is started on the local CPU.
+ */
+static void z069_hk_add_timer(struct timer_list *timer, unsigned long expires)
+{
+	unsigned int cpu = z069_hk_cpu();
+
+	if(cpu >= nr_cpu_ids) {
+		mod_timer(timer, expires);
+		return;
+	}
+	timer->expires = expires;
+	add_timer_on(timer, cpu);
+}
+
+/*******************************************************************/
+/** Queue a work item on a housekeeping CPU
+ */
+static void z069_hk_queue_work(struct work_struct *work)
+{
+	unsigned int cpu = z069_hk_cpu();
+
+	if(cpu >= nr_cpu_ids)
+		schedule_work(work);
+	else
+		queue_work_on(cpu, system_wq, work);
+}
+
+/*******************************************************************/
+/** Account kernel side activity running outside the housekeeping CPUs
+ *
+ *  Normally only happens when a housekeeping CPU went offline.
+ */
+static void z069_hk_check(void)
+{
+	struct cpumask *mask;
+
+	rcu_read_lock();
+	mask = rcu_dereference(G_hkMask);
+	if(mask && !cpumask_test_cpu(raw_smp_processor_id(), mask))
+		atomic_inc(&G_hkMisses);
+	rcu_read_unlock();
+}
+
+/*******************************************************************/
+/** Replace the housekeeping CPU mask
+ *
+ *  The new mask is published as a whole, so readers see either the old
+ *  or the new mask, never a mix of both.
+ *
+ *  \param newMask  \IN	new housekeeping CPUs, NULL to free the mask
+ *
+ *  \return 0 or -ENOMEM
+ */
+static int z069_hk_publish(const struct cpumask *newMask)
+{
+	struct cpumask *mask = NULL, *old;
+
+	if(newMask) {
+		if((mask = kmalloc(cpumask_size(), GFP_KERNEL)) == NULL)
+			return -ENOMEM;
+		cpumask_copy(mask, newMask);
+	}
+
+	mutex_lock(&G_hkLock);
+	old = rcu_dereference_protected(G_hkMask, lockdep_is_held(&G_hkLock));
+	rcu_assign_pointer(G_hkMask, mask);
+	mutex_unlock(&G_hkLock);
+
+	synchronize_rcu();
+	kfree(old);
+	return 0;
+}
+
+/*******************************************************************/
+/** Start the timers forwarding a coalesced ping, G_pingLock held
+ *
+ *  Normally G_pingTimer triggers once the coalescing interval since the
+ *  last trigger has passed. With keepalive_defer the trigger is issued
+ *  by the deferrable G_pingDeferTimer instead, which does not wake an
+ *  idle CPU and runs with the next wakeup after the interval.
+ *  G_pingTimer is then set to the point where only keepalive_guard_pct
+ *  of the timeout is left and forces the trigger if no wakeup came
+ *  along until then. Deferring is skipped if that backstop could expire
+ *  after the hardware timeout (short timeouts) or would not expire
+ *  after the interval.
+ *
+ *  \param now       \IN	current time [ns]
+ *  \param interval  \IN	coalescing interval [ns]
+ */
+static void wdt_ping_timers_start(u64 now, u64 interval)
+{
+	unsigned long early, late;
+	u64 timeoutNs, lateNs;
+	int guard;
+
+	early = jiffies + 1 + nsecs_to_jiffies(G_lastTrigNs + interval - now);
+
+	if(keepalive_defer) {
+		guard = clamp(keepalive_guard_pct, Z069_GUARD_PCT_MIN, 50);
+		timeoutNs = div_u64((u64)G_wdMargin * NSEC_PER_SEC, Z069_WDT_TIMER_FREQUENZ);
+		lateNs = div_u64(timeoutNs * (100 - guard), 100);
+		late = jiffies + (G_lastTrigNs + lateNs > now ?
+						  nsecs_to_jiffies(G_lastTrigNs + lateNs - now) : 0);
+
+		if(wdt_timer_late_ns(lateNs) < timeoutNs && time_after(late, early)) {
+			G_pingEarly = early;
+			z069_hk_add_timer(&G_pingDeferTimer, early);
+			z069_hk_add_timer(&G_pingTimer, late);
+			return;
+		}
+	}
+	z069_hk_add_timer(&G_pingTimer, early);
+}
+
+/*******************************************************************/
+/** Ping the watchdog on behalf of userspace
+ *
+ *  Always updates the liveness timestamp. If the hardware was triggered
+ *  less than the coalescing interval ago, the ping is not forwarded;
+ *  instead G_pingTimer triggers the hardware once that interval has
+ *  passed. wdt_coalesce_interval() makes sure the timer expires before
+ *  the hardware timeout, so a living client never runs into a reset
+ *  unless timer softirqs are held off for the remaining margin.
+ *
+ *  With keepalive_defer the trigger rides along with other wakeups,
+ *  see wdt_ping_timers_start().
+ */
+static void wdt_ping(void)
+{
+	u64 now = ktime_get_ns();
+	u64 interval = wdt_coalesce_interval();
+	int forward = 1;
+
+	spin_lock_bh(&G_pingLock);
+	if(auto_timeout && G_lastPingNs) {
+		G_autoWin[G_autoIdx] = (u32)min_t(u64, div_u64(now - G_lastPingNs, NSEC_PER_USEC), U32_MAX);
+		G_autoIdx = (G_autoIdx + 1) % Z069_AUTO_WINDOW;
+		if(G_autoFill < Z069_AUTO_WINDOW)
+			G_autoFill++;
+		if(++G_autoNew >= Z069_AUTO_RECALC && G_autoFill == Z069_AUTO_WINDOW) {
+			G_autoNew = 0;
+			z069_hk_queue_work(&G_autoWork);
+		}
+	}
+	G_lastPingNs = now;
+	if(interval && (now - G_lastTrigNs) < interval) {
+		forward = 0;
+		G_pingsCoalesced++;
+		if(!timer_pending(&G_pingTimer) && !timer_pending(&G_pingDeferTimer))
+			wdt_ping_timers_start(now, interval);
+	} else {
+		G_pingsForwarded++;
+	}
+	spin_unlock_bh(&G_pingLock);
+
+	if(forward)
+		wdt_trigger();
+}
+
+/*******************************************************************/
+/** Restart the ping timers after a timeout load
+ *
+ *  Timers still pending expire relative to the old timeout, which is
+ *  too late after shortening it. They are stopped, and if a ping is
+ *  still not forwarded, it is forwarded now or the timers are started
+ *  again for the new coalescing interval.
+ */
+static void wdt_ping_timers_reload(void)
+{
+	u64 now, interval;
+	int forward = 0;
+
+	del_timer_sync(&G_pingDeferTimer);
+	del_timer_sync(&G_pingTimer);
+
+	now = ktime_get_ns();
+	interval = wdt_coalesce_interval();
+
+	spin_lock_bh(&G_pingLock);
+	if(G_lastPingNs > G_lastTrigNs &&
+	   !timer_pending(&G_pingTimer) && !timer_pending(&G_pingDeferTimer)) {
+		if(interval && (now - G_lastTrigNs) < interval)
+			wdt_ping_timers_start(now, interval);
+		else
+			forward = 1;
+	}
+	spin_unlock_bh(&G_pingLock);
+
+	if(forward)
+		wdt_trigger();
+}
+
+/*******************************************************************/
+/** Forward a coalesced ping to the hardware
+ *
+ *  \param deferrable  \IN	called by G_pingDeferTimer
+ */
+static void wdt_ping_timer_expired(int deferrable)
+{
+	int pending;
+
+	z069_hk_check();
+	spin_lock_bh(&G_pingLock);
+	pending = G_lastPingNs > G_lastTrigNs;
+	if(pending) {
+		if(deferrable)
+			G_pingsPiggybacked++;
+		else if(timer_pending(&G_pingDeferTimer) && time_after(jiffies, G_pingEarly))
+			G_pingsForced++;
+		else
+			G_pingsDeferred++;
+	}
+	spin_unlock_bh(&G_pingLock);
+
+	/* whichever timer comes first does the job */
+	del_timer(deferrable ? &G_pingTimer : &G_pingDeferTimer);
+
+	if(pending)
+		wdt_trigger();
+}
+
+/*******************************************************************/
+/** Timers: forward a coalesced ping to the hardware
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
+static void wdt_ping_timer_fn(unsigned long data)
+{
+	wdt_ping_timer_expired((int)data);
+}
+#else
+static void wdt_ping_timer_fn(struct timer_list *t)
+{
+	wdt_ping_timer_expired(t == &G_pingDeferTimer);
+}
+#endif
+
+static int wdt_ping_stats_show(struct seq_file *m, void *v)
+{
+	spin_lock_bh(&G_pingLock);
+	seq_printf(m, "interval_ns %llu\nforwarded %lu\ncoalesced %lu\ndeferred %lu\n"
+			   "piggybacked %lu\nforced %lu\n",
+			   (unsigned long long)wdt_coalesce_interval(),
+			   G_pingsForwarded, G_pingsCoalesced, G_pingsDeferred,
+			   G_pingsPiggybacked, G_pingsForced);
+	spin_unlock_bh(&G_pingLock);
+	return 0;
+}
+
+static int wdt_ping_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, wdt_ping_stats_show, NULL);
+}
+
+static const struct file_operations wdt_ping_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= wdt_ping_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*******************************************************************/
+/** Work: recalculate the auto timeout from the ping interval window
+ *
+ *  The new timeout is the configured percentile of the last
+ *  Z069_AUTO_WINDOW ping intervals plus auto_headroom_pct, clamped to
+ *  auto_min_ms..auto_max_ms and to the counter range. It is only loaded
+ *  when it differs by more than 1/8 from the current one, and only if
+ *  no one else loaded or disabled the timer while it was computed. Every
+ *  adjustment is logged and sent as KOBJ_CHANGE uevent of the watchdog
+ *  device with Z069_EVENT=AUTO_TIMEOUT, OLD_MS, NEW_MS and PCT_US.
+ */
+static void wdt_auto_work_fn(struct work_struct *work)
+{
+	char evEnv[] = "Z069_EVENT=AUTO_TIMEOUT";
+	char oldEnv[24], newEnv[24], pctEnv[24];
+	char *envp[] = { evEnv, oldEnv, newEnv, pctEnv, NULL };
+	int pct = clamp(auto_percentile, 1, 100);
+	int loMs, hiMs, oldVal, val;
+	u64 ms;
+	u32 pctUs;
+
+	z069_hk_check();
+	oldVal = READ_ONCE(G_wdMargin);
+	spin_lock_bh(&G_pingLock);
+	memcpy(G_autoSort, G_autoWin, sizeof(G_autoSort));
+	spin_unlock_bh(&G_pingLock);
+
+	sort(G_autoSort, Z069_AUTO_WINDOW, sizeof(u32), z069_lat_cmp, NULL);
+	pctUs = G_autoSort[(Z069_AUTO_WINDOW - 1) * pct / 100];
+	G_autoPctUs = pctUs;
+
+	loMs = max(auto_min_ms, Z069_WDT_COUNTER_MIN * Z069_MS_PER_COUNT);
+	hiMs = min(auto_max_ms, Z069_WDT_COUNTER_MAX * Z069_MS_PER_COUNT);
+	ms = DIV_ROUND_UP_ULL((u64)pctUs * (100 + max(auto_headroom_pct, 0)), 100 * USEC_PER_MSEC);
+	ms = clamp_t(u64, ms, loMs, max(loMs, hiMs));
+	val = clamp_t(int, DIV_ROUND_UP((int)ms, Z069_MS_PER_COUNT),
+				  Z069_WDT_COUNTER_MIN, Z069_WDT_COUNTER_MAX);
+
+	mutex_lock(&G_loadLock);
+	if(!auto_timeout || !oldVal || G_wdMargin != oldVal ||
+	   abs(val - oldVal) <= oldVal / 8 || wdt_val_load_locked(val) < 0) {
+		mutex_unlock(&G_loadLock);
+		return;
+	}
+	G_autoAdjusts++;
+	mutex_unlock(&G_loadLock);
+
+	printk(KERN_INFO PFX "auto timeout %d ms -> %d ms (p%d interval %u us)\n",
+		   oldVal * Z069_MS_PER_COUNT, val * Z069_MS_PER_COUNT, pct, pctUs);
+
+	snprintf(oldEnv, sizeof(oldEnv), "OLD_MS=%d", oldVal * Z069_MS_PER_COUNT);
+	snprintf(newEnv, sizeof(newEnv), "NEW_MS=%d", val * Z069_MS_PER_COUNT);
+	snprintf(pctEnv, sizeof(pctEnv), "PCT_US=%u", pctUs);
+	if(z069_watchdog_miscdev.this_device)
+		kobject_uevent_env(&z069_watchdog_miscdev.this_device->kobj, KOBJ_CHANGE, envp);
+}
+
+/*******************************************************************/
+/** Start a new ping interval window for a new owner of the watchdog
+ */
+static void wdt_auto_window_reset(void)
+{
+	spin_lock_bh(&G_pingLock);
+	G_lastPingNs = 0;
+	G_autoIdx = G_autoFill = G_autoNew = 0;
+	spin_unlock_bh(&G_pingLock);
+}
+
+static int wdt_auto_show(struct seq_file *m, void *v)
+{
+	seq_printf(m, "enabled %d\ntimeout_ms %d\npercentile_us %u\nsamples %d\nadjustments %lu\n",
+			   auto_timeout, G_wdMargin * Z069_MS_PER_COUNT, G_autoPctUs,
+			   G_autoFill, G_autoAdjusts);
+	return 0;
+}
+
+static int wdt_auto_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, wdt_auto_show, NULL);
+}
+
+static const struct file_operations wdt_auto_fops = {
+	.owner		= THIS_MODULE,
+	.open		= wdt_auto_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static ssize_t z069_write(struct file *file, const char *buf, size_t count, loff_t *ppos)
+{
+	int i=0;
+	Z069DBG("z069_write:\n");
+
+	if (count) {
+		if (!nowayout) {
+			G_expectClose = 0;
+			for (i = 0; i != count; i++) {
+				char c;
+				if(get_user(c, buf+i))
+					return -EFAULT;
+				if (c == 'V') {
+					Z069DBG("got 'V'\n");
+					G_expectClose = 1;
+				}
+			}
+		}
+		wdt_ping();
+	}
+	return count;
+}
+
+static ssize_t z069_read(struct file *file, char *buf, size_t count,
+		loff_t *ptr)
+{
+	return -EINVAL;
+}
+
+/*******************************************************************/
+/** z069_SetResetMask:
+ *	\param value \IN    value to be set to reset mask register
+ *
+ *	\return 0 or -EBUSY while a sync reset is pending
+ */
+int z069_SetResetMask(u_int32 value)
+{
+	int ret = -EBUSY;
+
+	Z069DBG("Z069_SetResetMask := 0x%08x\n", value);
+	down(&G_wdUnit->lock);
+	if(!G_resetPending) {
+		z069_audit(Z069_AUDIT_SET_MASK, value);
+		Z69WRITE_D16(G_wdUnit, Z069_RST_RMR, value);
+		ret = 0;
+	}
+	up(&G_wdUnit->lock);
+	return ret;
+}
+
+/*******************************************************************/
+/**	Z069_GetResetMask:
+ *	\param value \OUT    read value from reset mask register
+ *
+ *	\return always 0
+ */
+int z069_GetResetMask(u_int32 *value)
+{
+	int retVal;
+
+	down(&G_wdUnit->lock);
+	retVal = Z69READ_D16(G_wdUnit, Z069_RST_RMR);
+	up(&G_wdUnit->lock);
+	Z069DBG("Z069_GetResetMask := 0x%08x\n", retVal);
+	*value = retVal;
+	return 0;
+}
+
+/*******************************************************************/
+/** z069_SetResetCause:
+ *	\param value \IN    value to be set to reset cause register
+ *
+ *	\return always 0
+ */
+int z069_SetResetCause(u_int32 value)
+{
+	Z069DBG("Z069_SetResetCause := 0x%08x\n", value);
+	z069_audit(Z069_AUDIT_SET_CAUSE, value);
+	down(&G_wdUnit->lock);
+	Z69WRITE_D16(G_wdUnit, Z069_RST_RCR, value);
+	up(&G_wdUnit->lock);
+	return 0;
+}
+
+/*******************************************************************/
+/** z069_GetResetCause:
+ *	\param value \OUT    value to be set to reset cause register
+ *
+ *	\return always 0
+ */
+int z069_GetResetCause(u_int32 *value)
+{
+	int retVal;
+
+	down(&G_wdUnit->lock);
+	retVal = Z69READ_D16(G_wdUnit, Z069_RST_RCR);
+	up(&G_wdUnit->lock);
+	Z069DBG("Z069_GetResetCause := 0x%08x\n", retVal);
+	*value = retVal;
+	return 0;
+}
+
+/*******************************************************************/
+/** z069_SetResetRequest:
+ *	\param value \IN    value to be set to reset request register
+ *
+ *	\return always 0
+ */
+int z069_SetResetRequest(u_int32 value)
+{
+	Z069DBG("Z069_SetResetRequest := 0x%08x\n", value);
+	z069_audit(Z069_AUDIT_SET_REQUEST, value);
+	down(&G_wdUnit->lock);
+	Z69WRITE_D16(G_wdUnit, Z069_RST_RRR, value);
+	up(&G_wdUnit->lock);
+	return 0;
+}
+
+/*******************************************************************/
+/** z069_GetResetRequest:
+ *	\param value \IN    value to be set to reset request register
+ *
+ *	\return always 0
+ */
+int z069_GetResetRequest(u_int32 *value)
+{
+	int retVal;
+
+	down(&G_wdUnit->lock);
+	retVal = Z69READ_D16(G_wdUnit, Z069_RST_RRR);
+	up(&G_wdUnit->lock);
+	Z069DBG("Z069_GetResetRequest := 0x%08x\n", retVal);
+	*value = retVal;
+	return 0;
+}
+
+/*******************************************************************/
+/** Take the watchdog for a new owner and arm it
+ *
+ *  Shared by open() and kernel clients attaching. Waits for a running
+ *  self-test. A watchdog adopted at probe keeps the timeout and trigger
+ *  phase handed over by the previous kernel unless a timeout is given;
+ *  otherwise the timeout is loaded and the trigger sequence restarted
+ *  at 0xAAAA. Then the watchdog reset is unmasked in RMR, the watchdog
+ *  triggered and a new ping interval window started.
+ *
+ *  \param time  \IN	timeout in 1/100s, 0 for the default timeout
+ *                    (falling back to the maximum if invalid)
+ *
+ *  \return 0 with G_openSem held, or negative error
+ */
+static int z069_wdg_arm(int time)
+{
+	u_int16 maskReg;
+	int ret;
+
+	if(down_trylock(&G_openSem)) {
+		flush_work(&G_selftestWork);
+		if(down_trylock(&G_openSem))
+			return -EBUSY;
+	}
+
+	if(G_wdAdopted && !time) {
+		/* keep timeout and trigger phase handed over by previous kernel */
+		G_wdAdopted = 0;
+	} else {
+		ret = wdt_timer_load(time ? time : G_defaultTimeout);
+		if(ret == -EINVAL && !time)
+			ret = wdt_timer_load(wdt_val2time( Z069_WDT_COUNTER_MAX));
+		if(ret < 0) {
+			up(&G_openSem);
+			return ret;
+		}
+
+		/* init WD trigger value register */
+		wdt_trigger_restart();
+	}
+
+	/* set Reset mask Register, considering the watchdog reset bit */
+	down(&G_wdUnit->lock);
+	maskReg = Z69READ_D16(G_wdUnit, Z069_RST_RMR) & ~(Z069_RST_WDG_BIT | wdg_bit);
+	z069_audit(Z069_AUDIT_SET_MASK, maskReg);
+	Z69WRITE_D16(G_wdUnit, Z069_RST_RMR, maskReg);
+	up(&G_wdUnit->lock);
+
+	wdt_trigger();
+	wdt_auto_window_reset();
+	return 0;
+}
+
+/*
+ * In-kernel API: Z069_RST_HANDLE methods
+ *
+ * Every z069_RstGet() returns a handle of its own (Z069_CLIENT) that
+ * references the unit. All methods may sleep. They return -ENODEV once
+ * the unit has been removed; the handle itself stays valid until
+ * z069_RstPut().
+ */
+#define Z069_HDL2CLIENT(h)	container_of(h, Z069_CLIENT, hdl)
+
+static int z069_hdl_reset(Z069_RST_HANDLE *this, u_int16 mask)
+{
+	Z069_UNIT *unit = Z069_HDL2CLIENT(this)->unit;
+	int ret = -ENODEV;
+
+	down(&unit->lock);
+	if(unit->base) {
+		Z069DBG("z069_hdl_reset unit %d := 0x%04x\n", unit->instance, mask);
+		z069_audit(Z069_AUDIT_SET_REQUEST, mask);
+		Z69WRITE_D16(unit, Z069_RST_RRR, mask);
+		ret = 0;
+	}
+	up(&unit->lock);
+	return ret;
+}
+
+static int z069_hdl_getResetCause(Z069_RST_HANDLE *this, u_int16 *causeP,
+								  int clearRstCause)
+{
+	Z069_UNIT *unit = Z069_HDL2CLIENT(this)->unit;
+	int ret = -ENODEV;
+
+	down(&unit->lock);
+	if(unit->base) {
+		*causeP = Z69READ_D16(unit, Z069_RST_RCR);
+		if(clearRstCause) {
+			z069_audit(Z069_AUDIT_SET_CAUSE, *causeP);
+			Z69WRITE_D16(unit, Z069_RST_RCR, *causeP);
+		}
+		ret = 0;
+	}
+	up(&unit->lock);
+	return ret;
+}
+
+static int z069_hdl_setResetMask(Z069_RST_HANDLE *this, u_int16 mask)
+{
+	Z069_UNIT *unit = Z069_HDL2CLIENT(this)->unit;
+	int ret = -ENODEV;
+
+	down(&unit->lock);
+	if(unit == G_wdUnit && G_resetPending) {
+		ret = -EBUSY;
+	} else if(unit->base) {
+		z069_audit(Z069_AUDIT_SET_MASK, mask);
+		Z69WRITE_D16(unit, Z069_RST_RMR, mask);
+		ret = 0;
+	}
+	up(&unit->lock);
+	return ret;
+}
+
+static int z069_hdl_getResetMask(Z069_RST_HANDLE *this, u_int16 *maskP)
+{
+	Z069_UNIT *unit = Z069_HDL2CLIENT(this)->unit;
+	int ret = -ENODEV;
+
+	down(&unit->lock);
+	if(unit->base) {
+		*maskP = Z69READ_D16(unit, Z069_RST_RMR);
+		ret = 0;
+	}
+	up(&unit->lock);
+	return ret;
+}
+
+/*******************************************************************/
+/** Attach a kernel client as owner of the watchdog
+ *
+ *  Only possible on the unit serving /dev/watchdog and only while
+ *  neither the device is open nor another client is attached; the
+ *  device cannot be opened while attached. Arms the watchdog the same
+ *  way as open(), see z069_wdg_arm().
+ *
+ *  \param timeout  \IN	timeout in 1/100s, 0 for the default timeout
+ */
+static int z069_hdl_attachWdog(Z069_RST_HANDLE *this, int timeout)
+{
+	Z069_CLIENT *client = Z069_HDL2CLIENT(this);
+	int ret;
+
+	mutex_lock(&G_clientLock);
+	if(client->unit != G_wdUnit) {
+		ret = -ENODEV;
+		goto out;
+	}
+	if(client->wdgAttached) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	if((ret = z069_wdg_arm(timeout)) < 0)
+		goto out;
+
+	client->wdgAttached = 1;
+	z069_audit(Z069_AUDIT_ATTACH, G_wdMargin);
+	ret = 0;
+out:
+	mutex_unlock(&G_clientLock);
+	return ret;
+}
+
+static int z069_hdl_triggerWdog(Z069_RST_HANDLE *this)
+{
+	Z069_CLIENT *client = Z069_HDL2CLIENT(this);
+	int ret = -ENODEV;
+
+	mutex_lock(&G_clientLock);
+	if(client->wdgAttached && client->unit == G_wdUnit) {
+		wdt_ping();
+		ret = 0;
+	}
+	mutex_unlock(&G_clientLock);
+	return ret;
+}
+
+static void z069_hdl_detachWdog(Z069_RST_HANDLE *this)
+{
+	Z069_CLIENT *client = Z069_HDL2CLIENT(this);
+
+	mutex_lock(&G_clientLock);
+	if(client->wdgAttached) {
+		client->wdgAttached = 0;
+		z069_audit(Z069_AUDIT_DETACH, 0);
+		if(client->unit == G_wdUnit)
+			wdt_timer_load(0);
+		up(&G_openSem);
+	}
+	mutex_unlock(&G_clientLock);
+}
+
+static const Z069_RST_HANDLE G_unitMethods = {
+	.reset		= z069_hdl_reset,
+	.getResetCause	= z069_hdl_getResetCause,
+	.setResetMask	= z069_hdl_setResetMask,
+	.getResetMask	= z069_hdl_getResetMask,
+	.attachWdog	= z069_hdl_attachWdog,
+	.triggerWdog	= z069_hdl_triggerWdog,
+	.detachWdog	= z069_hdl_detachWdog,
+};
+
+static void z069_unit_release(struct kref *ref)
+{
+	kfree(container_of(ref, Z069_UNIT, ref));
+}
+
+/*******************************************************************/
+/** Get a reference counted handle to a 16Z069 unit
+ *
+ *  \param pdev      \IN	FPGA the unit belongs to, NULL for any
+ *  \param instance  \IN	index of the unit among the matching units,
+ *                        in probe order (with pdev NULL this is the same
+ *                        numbering as the module parameter device)
+ *
+ *  \return new handle of the caller or NULL if there is no such unit
+ */
+Z069_RST_HANDLE *z069_RstGet(struct pci_dev *pdev, int instance)
+{
+	Z069_CLIENT *client;
+	Z069_UNIT *unit;
+
+	if((client = kzalloc(sizeof(*client), GFP_KERNEL)) == NULL)
+		return NULL;
+
+	mutex_lock(&G_unitListLock);
+	list_for_each_entry(unit, &G_unitList, node) {
+		if(pdev && unit->pdev != pdev)
+			continue;
+		if(instance-- == 0) {
+			kref_get(&unit->ref);
+			client->unit = unit;
+			break;
+		}
+	}
+	mutex_unlock(&G_unitListLock);
+
+	if(!client->unit) {
+		kfree(client);
+		return NULL;
+	}
+	client->hdl = G_unitMethods;
+	return &client->hdl;
+}
+EXPORT_SYMBOL_GPL(z069_RstGet);
+
+/*******************************************************************/
+/** Release a handle got by z069_RstGet()
+ *
+ *  Detaches the watchdog if attached through this handle.
+ *
+ *  \param hdlP  \IN	handle, \OUT set to NULL
+ */
+void z069_RstPut(Z069_RST_HANDLE **hdlP)
+{
+	Z069_CLIENT *client;
+
+	if(!hdlP || !*hdlP)
+		return;
+
+	client = Z069_HDL2CLIENT(*hdlP);
+	z069_hdl_detachWdog(*hdlP);
+	*hdlP = NULL;
+	kref_put(&client->unit->ref, z069_unit_release);
+	kfree(client);
+}
+EXPORT_SYMBOL_GPL(z069_RstPut);
+
+/*******************************************************************/
+/** Sync filesystems and reset, bounded by the hardware watchdog
+ *
+ *  Loads the watchdog with the caller's deadline, unmasks the watchdog
+ *  reset (wdg_bit) in RMR and stops all further triggering. From then
+ *  on timeout loads and RMR writes fail with -EBUSY. Then the
+ *  filesystems are synced and sr->request is written to Z069_RST_RRR.
+ *  If the sync hangs or the request does not reset the board (e.g.
+ *  request 0), the watchdog resets it at the deadline.
+ *
+ *  \param sr  \IN	deadline and reset request value
+ *
+ *  \return 0 if still running after the request, -EOPNOTSUPP if wdg_bit
+ *          is unknown, -EIO if the watchdog reset cannot be unmasked,
+ *          or other negative error
+ */
+#ifdef Z069_HAVE_SYNC_HELPER
+static int z069_sync_reset(Z069_SYNC_RESET *sr)
+{
+	u16 maskReg;
+	int val, ret;
+
+	if(!capable(CAP_SYS_BOOT))
+		return -EPERM;
+
+	if(!z069_wdg_bit_valid())
+		return -EOPNOTSUPP;
+
+	val = DIV_ROUND_UP(sr->deadlineMs, Z069_MS_PER_COUNT);
+	if((val < Z069_WDT_COUNTER_MIN) || (val > Z069_WDT_COUNTER_MAX))
+		return -EINVAL;
+
+	z069_audit(Z069_AUDIT_SYNC_RESET, val);
+	mutex_lock(&G_loadLock);
+	if((ret = wdt_val_load_locked(val)) < 0) {
+		mutex_unlock(&G_loadLock);
+		return ret;
+	}
+
+	down(&G_wdUnit->lock);
+	maskReg = Z69READ_D16(G_wdUnit, Z069_RST_RMR) & ~wdg_bit;
+	z069_audit(Z069_AUDIT_SET_MASK, maskReg);
+	Z69WRITE_D16(G_wdUnit, Z069_RST_RMR, maskReg);
+	if(Z69READ_D16(G_wdUnit, Z069_RST_RMR) & wdg_bit) {
+		up(&G_wdUnit->lock);
+		mutex_unlock(&G_loadLock);
+		printk(KERN_ERR PFX "cannot unmask watchdog reset, no sync reset\n");
+		return -EIO;
+	}
+	spin_lock_bh(&G_pingLock);
+	G_resetPending = 1;
+	spin_unlock_bh(&G_pingLock);
+	up(&G_wdUnit->lock);
+	mutex_unlock(&G_loadLock);
+
+	del_timer_sync(&G_pingDeferTimer);
+	del_timer_sync(&G_pingTimer);
+	cancel_work_sync(&G_autoWork);
+
+	printk(KERN_EMERG PFX "syncing filesystems, reset in %d ms at the latest\n",
+		   val * Z069_MS_PER_COUNT);
+
+	ksys_sync_helper();
+
+	printk(KERN_EMERG PFX "sync done, requesting reset 0x%04x\n", sr->request);
+	z069_SetResetRequest(sr->request);
+
+	return 0;
+}
+#else
+static int z069_sync_reset(Z069_SYNC_RESET *sr)
+{
+	return -EOPNOTSUPP; /* no in-kernel sync exported to modules */
+}
+#endif
+
+/*******************************************************************/
+/** file ops: open the device
+ *
+ * The watchdog device is single open and on opening we activate
+ * the watchdog with its default value. If the self-test holds the
+ * device, open() waits for it to finish.
+ *
+ */
+static int z069_open(struct inode *inode, struct file *file)
+{
+	int ret;
+
+	Z069DBG("z069_open\n");
+
+	/* activate watchdog with default timeout */
+	if((ret = z069_wdg_arm(0)) < 0)
+		return ret;
+
+	z069_audit(Z069_AUDIT_OPEN, 0);
+	G_expectClose = 0;
+
+	return 0;
+
+}
+
+/*******************************************************************/
+/** file ops: release the device
+ *
+ */
+static int z069_release(struct inode *inode, struct file *file)
+{
+	Z069DBG("z069_release\n");
+	z069_audit(Z069_AUDIT_RELEASE, G_expectClose);
+
+	if(G_expectClose) {
+		wdt_timer_load(0); /* disable wdog */
+	} else {
+		printk(KERN_DEBUG PFX "Unexpected close, not stopping timer!\n");
+		wdt_trigger();
+	}
+	up(&G_openSem);
+	return 0;
+}
+
+static const struct watchdog_info z069_wdt_info = {
+	.options = WDIOF_SETTIMEOUT | WDIOF_KEEPALIVEPING | WDIOF_MAGICCLOSE,
+	.identity = "Z069 WDT",
+	.firmware_version = 1,
+};
+
+
+/*******************************************************************/
+/** file ops: ioctl handling
+ *
+ */
+static long z069_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	int margin;
+	int retVal = 0;
+	Z069_SYNC_RESET syncRst;
+
+	Z069DBG("wdt_ioctl: ");
+	switch(cmd) {
 
 	/* official watchdog-API commands */
 	case WDIOC_GETSUPPORT:
@@ -459,13 +1977,12 @@ static long z069_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		break;
 	case WDIOC_KEEPALIVE:
 		Z069DBG("WDIOC_KEEPALIVE\n");
-		wdt_trigger();
+		wdt_ping();
 		break;
 	case WDIOC_SETTIMEOUT:
 		Z069DBG("WDIOC_SETTIMEOUT\n");
 		if(get_user(margin, (int *)arg))
 			return -EFAULT;
-		G_wdMargin = margin;
 		retVal = wdt_timer_load(margin * 100 );
 		break;
 	case WDIOC_GETTIMEOUT:
@@ -478,7 +1995,7 @@ static long z069_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case RSTIOC_SET_RESET_MASK:
 		Z069DBG("RSTIOC_SET_RESET_MASK\n");
 		get_user(margin, (int *)arg);
-		z069_SetResetMask(margin);
+		retVal = z069_SetResetMask(margin);
 		break;
 	case RSTIOC_GET_RESET_MASK:
 		Z069DBG("RSTIOC_GET_RESET_MASK\n");
@@ -505,6 +2022,12 @@ static long z069_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		z069_GetResetRequest((u_int32 *)&margin);
 		retVal = put_user(margin, (int *)arg);
 		break;
+	case RSTIOC_SYNC_RESET:
+		Z069DBG("RSTIOC_SYNC_RESET\n");
+		if(copy_from_user(&syncRst, (Z069_SYNC_RESET *)arg, sizeof(syncRst)))
+			return -EFAULT;
+		retVal = z069_sync_reset(&syncRst);
+		break;
 	default:
 		Z069DBG("not supported\n");
 		return -ENOTTY;
@@ -512,86 +2035,480 @@ static long z069_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	return retVal;
 }
 
-static int z069_probe(CHAMELEON_UNIT_T *chu)
+/*******************************************************************/
+/** Leave a running watchdog in a defined state for the next owner
+ *
+ *  If the watchdog is enabled and handover_timeout is set, the timer
+ *  is reloaded with handover_timeout and the trigger sequence is
+ *  restarted at 0xAAAA, followed by one trigger. WTR and WVR keep this
+ *  state over a kexec or a module reload, so the next z069_probe()
+ *  finds the watchdog running with a known timeout and adopts it.
+ *  A disabled watchdog is left disabled.
+ */
+static void z069_handover(void)
 {
-	int ret = 0;
-	int memReq = 0;
+	int val;
 
-	sema_init(&G_openSem, 1);
-	sema_init(&G_wdtLock, 1);
+	if(handover_timeout <= 0)
+		return;
+
+	if(!(Z69READ_D16(G_wdUnit, Z069_RST_WTR) & Z069_RST_WTR_WDEN))
+		return;
+
+	if((val = wdt_time2val(handover_timeout * 100)) < 0) {
+		printk(KERN_ERR PFX "invalid handover_timeout %d, watchdog left unchanged\n",
+			   handover_timeout);
+		return;
+	}
+
+	mutex_lock(&G_loadLock);
+	if(G_resetPending) {
+		/* keep the sync reset deadline */
+		mutex_unlock(&G_loadLock);
+		return;
+	}
+	z069_audit(Z069_AUDIT_LOAD, val);
+	down(&G_wdUnit->lock);
+	Z69WRITE_D16(G_wdUnit, Z069_RST_WTR, val | Z069_RST_WTR_WDEN);
+	G_wdMargin = val;
+	up(&G_wdUnit->lock);
+	wdt_trigger_restart();
+	wdt_ping_timers_reload();
+	mutex_unlock(&G_loadLock);
+
+	printk(KERN_INFO PFX "watchdog left armed for handover, timeout %ds\n",
+		   handover_timeout);
+}
+
+/*******************************************************************/
+/** Reboot notifier, also called by kernel_kexec()
+ */
+static int z069_reboot_notify(struct notifier_block *nb, unsigned long code,
+							  void *unused)
+{
+	if(code == SYS_RESTART)
+		z069_handover();
+
+	return NOTIFY_DONE;
+}
+
+/*******************************************************************/
+/** Adopt a watchdog already running at probe time
+ *
+ *  Takes over timeout and trigger phase as found in WTR/WVR without
+ *  reloading the timer; the next open() keeps them as well.
+ */
+static void z069_adopt(void)
+{
+	u16 wtr = Z69READ_D16(G_wdUnit, Z069_RST_WTR);
+
+	if(!(wtr & Z069_RST_WTR_WDEN))
+		return;
+
+	G_wdMargin = wtr & Z069_RST_WTR_WDET_MASK;
+	G_wdAdopted = 1;
+	wdt_trigger();
+
+	printk(KERN_INFO PFX "adopting running watchdog, timeout %d.%02ds\n",
+		   wdt_val2time(G_wdMargin) / 100, wdt_val2time(G_wdMargin) % 100);
+}
+
+/*******************************************************************/
+/** Work: non-destructive watchdog self-test
+ *
+ *  Masks the watchdog reset (wdg_bit) in RMR, loads the minimum
+ *  timeout via wdt_timer_load() and waits until the expiry is latched
+ *  in RCR. Afterwards the watchdog is disabled, the latched bit is
+ *  cleared and RMR is restored. Skipped if wdg_bit is unknown, the device is in use, the watchdog is running, the
+ *  cause is already latched or the watchdog reset cannot be masked.
+ *  The device is held for up to Z069_SELFTEST_WAIT_MS meanwhile.
+ */
+static void z069_selftest_fn(struct work_struct *work)
+{
+	u16 wdgBit = (u16)wdg_bit;
+	u16 rmr, rcr, latched = 0;
+	u64 t0, elapsedUs = 0;
+	int val, expectedUs;
+
+	strscpy(G_selftestResult, "running", sizeof(G_selftestResult));
+
+	if(!z069_wdg_bit_valid()) {
+		strscpy(G_selftestResult, "skipped: wdg_bit unknown", sizeof(G_selftestResult));
+		return;
+	}
+
+	if(down_trylock(&G_openSem)) {
+		strscpy(G_selftestResult, "skipped: watchdog in use", sizeof(G_selftestResult));
+		return;
+	}
+
+	down(&G_wdUnit->lock);
+	if(Z69READ_D16(G_wdUnit, Z069_RST_WTR) & Z069_RST_WTR_WDEN) {
+		up(&G_wdUnit->lock);
+		strscpy(G_selftestResult, "skipped: watchdog running", sizeof(G_selftestResult));
+		goto out;
+	}
+	rcr = Z69READ_D16(G_wdUnit, Z069_RST_RCR);
+	if(rcr & wdgBit) {
+		up(&G_wdUnit->lock);
+		strscpy(G_selftestResult, "skipped: cause already latched in RCR", sizeof(G_selftestResult));
+		goto out;
+	}
+	rmr = Z69READ_D16(G_wdUnit, Z069_RST_RMR);
+	z069_audit(Z069_AUDIT_SET_MASK, rmr | wdgBit);
+	Z69WRITE_D16(G_wdUnit, Z069_RST_RMR, rmr | wdgBit);
+	if((Z69READ_D16(G_wdUnit, Z069_RST_RMR) & wdgBit) != wdgBit) {
+		z069_audit(Z069_AUDIT_SET_MASK, rmr);
+		Z69WRITE_D16(G_wdUnit, Z069_RST_RMR, rmr);
+		up(&G_wdUnit->lock);
+		strscpy(G_selftestResult, "fail: cannot mask watchdog reset", sizeof(G_selftestResult));
+		goto out;
+	}
+	up(&G_wdUnit->lock);
+
+	val = wdt_timer_load(Z069_SELFTEST_TIME);
+	t0 = ktime_get_ns();
+	expectedUs = val * (USEC_PER_SEC / Z069_WDT_TIMER_FREQUENZ);
+
+	while(elapsedUs < Z069_SELFTEST_WAIT_MS * USEC_PER_MSEC) {
+		usleep_range(100, 200);
+		down(&G_wdUnit->lock);
+		latched = Z69READ_D16(G_wdUnit, Z069_RST_RCR) & wdgBit;
+		up(&G_wdUnit->lock);
+		elapsedUs = div_u64(ktime_get_ns() - t0, NSEC_PER_USEC);
+		if(latched)
+			break;
+	}
+
+	wdt_timer_load(0);
+
+	down(&G_wdUnit->lock);
+	if(latched) {
+		z069_audit(Z069_AUDIT_SET_CAUSE, latched);
+		Z69WRITE_D16(G_wdUnit, Z069_RST_RCR, latched); /* rwc */
+	}
+	z069_audit(Z069_AUDIT_SET_MASK, rmr);
+	Z69WRITE_D16(G_wdUnit, Z069_RST_RMR, rmr);
+	up(&G_wdUnit->lock);
+
+	if(!latched)
+		snprintf(G_selftestResult, sizeof(G_selftestResult),
+				 "fail: no expiry within %d ms", Z069_SELFTEST_WAIT_MS);
+	else
+		snprintf(G_selftestResult, sizeof(G_selftestResult), "%s: expected %d us measured %llu us",
+				 (elapsedUs >= expectedUs / 2 && elapsedUs <= expectedUs * 3) ? "pass" : "fail",
+				 expectedUs, (unsigned long long)elapsedUs);
+out:
+	up(&G_openSem);
+	printk(KERN_INFO PFX "self-test %s\n", G_selftestResult);
+}
+
+/*
+ * sysfs attributes of the watchdog device
+ */
+static ssize_t housekeeping_cpus_show(struct device *dev,
+									  struct device_attribute *attr, char *buf)
+{
+	struct cpumask *mask;
+	ssize_t ret = 0;
+
+	rcu_read_lock();
+	mask = rcu_dereference(G_hkMask);
+	if(mask)
+		ret = scnprintf(buf, PAGE_SIZE, "%*pbl\n", cpumask_pr_args(mask));
+	rcu_read_unlock();
+	return ret;
+}
+
+static ssize_t housekeeping_cpus_store(struct device *dev,
+									   struct device_attribute *attr,
+									   const char *buf, size_t count)
+{
+	cpumask_var_t newMask;
+	char *str;
+	int ret;
+
+	if(!alloc_cpumask_var(&newMask, GFP_KERNEL))
+		return -ENOMEM;
+
+	if((str = kstrndup(buf, count, GFP_KERNEL)) == NULL) {
+		free_cpumask_var(newMask);
+		return -ENOMEM;
+	}
+
+	ret = cpulist_parse(strim(str), newMask);
+	if(!ret && !cpumask_intersects(newMask, cpu_online_mask))
+		ret = -EINVAL;
+	if(!ret)
+		ret = z069_hk_publish(newMask);
+	if(!ret)
+		ret = count;
+
+	kfree(str);
+	free_cpumask_var(newMask);
+	return ret;
+}
+
+static ssize_t housekeeping_misses_show(struct device *dev,
+										struct device_attribute *attr, char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%d\n", atomic_read(&G_hkMisses));
+}
+
+static DEVICE_ATTR(housekeeping_cpus, S_IRUGO | S_IWUSR,
+				   housekeeping_cpus_show, housekeeping_cpus_store);
+static DEVICE_ATTR(housekeeping_misses, S_IRUGO, housekeeping_misses_show, NULL);
+
+static ssize_t selftest_show(struct device *dev, struct device_attribute *attr,
+							 char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%s\n", G_selftestResult);
+}
+
+static DEVICE_ATTR(selftest, S_IRUGO, selftest_show, NULL);
+
+static struct attribute *z069_attrs[] = {
+	&dev_attr_housekeeping_cpus.attr,
+	&dev_attr_housekeeping_misses.attr,
+	&dev_attr_selftest.attr,
+	NULL
+};
+
+static const struct attribute_group z069_attr_group = {
+	.attrs = z069_attrs,
+};
+
+static const struct attribute_group *z069_attr_groups[] = {
+	&z069_attr_group,
+	NULL
+};
+
+/*******************************************************************/
+/** Initialize the housekeeping CPU mask
+ *
+ *  Defaults to the kernel's timer housekeeping CPUs, i.e. all CPUs not
+ *  isolated by nohz_full; hk_cpus overrides this.
+ */
+static void z069_hk_init(void)
+{
+	cpumask_var_t mask;
+
+	if(!alloc_cpumask_var(&mask, GFP_KERNEL))
+		goto nomem;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,18,0)
+	cpumask_copy(mask, housekeeping_cpumask(HK_TYPE_TIMER));
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,15,0)
+	cpumask_copy(mask, housekeeping_cpumask(HK_FLAG_TIMER));
+#else
+	cpumask_copy(mask, cpu_possible_mask);
+#endif
+
+	if(hk_cpus && *hk_cpus) {
+		if(cpulist_parse(hk_cpus, mask) ||
+		   !cpumask_intersects(mask, cpu_online_mask)) {
+			printk(KERN_ERR PFX "invalid hk_cpus \"%s\", using all CPUs\n", hk_cpus);
+			cpumask_copy(mask, cpu_possible_mask);
+		}
+	}
+
+	if(z069_hk_publish(mask)) {
+		free_cpumask_var(mask);
+		goto nomem;
+	}
+	printk(KERN_INFO PFX "housekeeping CPUs %*pbl\n", cpumask_pr_args(mask));
+	free_cpumask_var(mask);
+	return;
+
+nomem:
+	printk(KERN_ERR PFX "no housekeeping CPU mask, using the local CPU\n");
+}
+
+/*******************************************************************/
+/** Set up the watchdog device on the selected unit
+ */
+static int z069_wdg_init(Z069_UNIT *unit)
+{
+	int ret;
 
-	/*--- check for the right Z069 device instance ---*/
-	if ( device != G_device_cnt++ ) {
-		return -ENODEV;
+	G_wdUnit = unit;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
+	setup_timer(&G_pingTimer, wdt_ping_timer_fn, 0);
+	setup_deferrable_timer(&G_pingDeferTimer, wdt_ping_timer_fn, 1);
+#else
+	timer_setup(&G_pingTimer, wdt_ping_timer_fn, 0);
+	timer_setup(&G_pingDeferTimer, wdt_ping_timer_fn, TIMER_DEFERRABLE);
+#endif
+	INIT_WORK(&G_autoWork, wdt_auto_work_fn);
+	INIT_WORK(&G_selftestWork, z069_selftest_fn);
+	z069_hk_init();
+
+	if(G_defaultTimeout == 0)
+		G_defaultTimeout = wdt_val2time( Z069_WDT_COUNTER_MAX);
+
+	Z069DBG("Default timeout=%d\n", G_defaultTimeout);
+
+	if(latency_stats)
+		z069_lat_calibrate();
+
+	z069_audit_init(unit);
+	z069_adopt();
+
+	G_debugfsDir = debugfs_create_dir(Z069_DEBUGFS_DIR, NULL);
+	if(!IS_ERR_OR_NULL(G_debugfsDir)) {
+		debugfs_create_file("latency", S_IRUGO, G_debugfsDir, NULL, &z069_lat_fops);
+		debugfs_create_file("ping_stats", S_IRUGO, G_debugfsDir, NULL, &wdt_ping_stats_fops);
+		debugfs_create_file("auto_timeout", S_IRUGO, G_debugfsDir, NULL, &wdt_auto_fops);
+		debugfs_create_file("audit", S_IRUGO, G_debugfsDir, NULL, &z069_audit_fops);
+		debugfs_create_file("audit_prev", S_IRUGO, G_debugfsDir, (void *)1, &z069_audit_fops);
+	}
+	z069_trace_init();
+
+	z069_watchdog_miscdev.groups = z069_attr_groups;
+	ret = misc_register(&z069_watchdog_miscdev);
+	if ( ret ) {
+		printk (KERN_ERR PFX "Cannot register watchdog misc device (error code %d)\n", ret );
+		z069_trace_exit();
+		debugfs_remove_recursive(G_debugfsDir);
+		z069_audit_exit();
+		z069_hk_publish(NULL);
+		G_wdUnit = NULL;
+		return ret;
 	}
+	register_reboot_notifier(&z069_reboot_nb);
+
+	if(selftest)
+		z069_hk_queue_work(&G_selftestWork);
+
+	return 0;
+}
+
+/*******************************************************************/
+/** Tear down the watchdog device, registers still mapped
+ *
+ *  Runs under G_clientLock, so kernel clients cannot trigger or load
+ *  the watchdog while it is taken down and see -ENODEV afterwards.
+ */
+static void z069_wdg_exit(void)
+{
+	mutex_lock(&G_clientLock);
+	unregister_reboot_notifier(&z069_reboot_nb);
+	misc_deregister(&z069_watchdog_miscdev);
+	cancel_work_sync(&G_selftestWork);
+	cancel_work_sync(&G_autoWork);
+	del_timer_sync(&G_pingDeferTimer);
+	del_timer_sync(&G_pingTimer);
+	z069_handover();
+	z069_trace_exit();
+	debugfs_remove_recursive(G_debugfsDir);
+	z069_audit_exit();
+	z069_hk_publish(NULL);
+	G_wdUnit = NULL;
+	mutex_unlock(&G_clientLock);
+}
+
+static void z069_unit_unmap(Z069_UNIT *unit)
+{
+	if(unit->ioMapped) {
+		release_region((unsigned long)unit->chu->phys, (unsigned long)Z069_REG_SIZE);
+	} else {
+		iounmap(unit->base);
+		release_mem_region((unsigned long)unit->chu->phys, (unsigned long)Z069_REG_SIZE);
+	}
+	unit->base = NULL;
+}
+
+static int z069_probe(CHAMELEON_UNIT_T *chu)
+{
+	Z069_UNIT *unit;
+
+	if((unit = kzalloc(sizeof(*unit), GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+
+	kref_init(&unit->ref);
+	sema_init(&unit->lock, 1);
+	unit->chu = chu;
+	unit->pdev = chu->pdev;
+	unit->instance = G_device_cnt++;
 
 	/*--- are we io-mapped ? ---*/
-	G_ioMapped = pci_resource_flags(chu->pdev, chu->bar) & IORESOURCE_IO;
+	unit->ioMapped = pci_resource_flags(chu->pdev, chu->bar) & IORESOURCE_IO;
 
 	printk(KERN_INFO "MEN 16Z069 Watchdog/Reset IP core driver.\n" );
-	printk(KERN_INFO "Found 16Z069 unit @ %p using %s-mapped access\n", chu->phys, G_ioMapped ? "IO" : "mem" );
+	printk(KERN_INFO "Found 16Z069 unit %d @ %p using %s-mapped access\n",
+		   unit->instance, chu->phys, unit->ioMapped ? "IO" : "mem" );
 
-	if ( G_ioMapped ) {
+	if ( unit->ioMapped ) {
 		if( request_region( (unsigned long)chu->phys, (unsigned long)Z069_REG_SIZE, "Z069_WDG") == NULL ) {
 			printk (KERN_ERR PFX " error on request_region\n");
 			goto out;
 		}
-		memReq++;
-		G_wdBase = (char*)chu->phys; /* IO-mapped addresses are used directly via inb/w/l, outb/w/l */
+		unit->base = (char*)chu->phys; /* IO-mapped addresses are used directly via inb/w/l, outb/w/l */
 	} else {
-		if ( request_mem_region((unsigned long)chu->phys, (unsigned long)Z069_REG_SIZE, "Z069_WDG" ) < 0 ) {
+		if ( request_mem_region((unsigned long)chu->phys, (unsigned long)Z069_REG_SIZE, "Z069_WDG" ) == NULL ) {
 			printk (KERN_ERR PFX " error on request_mem_region\n");
 			goto out;
 		}
 
-		memReq++;
-		if((G_wdBase = (char*)ioremap((unsigned long)chu->phys, Z069_REG_SIZE)) == NULL)
+		if((unit->base = (char*)ioremap((unsigned long)chu->phys, Z069_REG_SIZE)) == NULL) {
+			release_mem_region((unsigned long)chu->phys, (unsigned long)Z069_REG_SIZE);
 			goto out;
+		}
 	}
 
-	if(G_defaultTimeout == 0)
-		G_defaultTimeout = wdt_val2time( Z069_WDT_COUNTER_MAX);
-
-	Z069DBG("Default timeout=%d\n", G_defaultTimeout);
-
-	ret = misc_register(&z069_watchdog_miscdev);
-	if ( ret ) {
-		printk (KERN_ERR PFX "Cannot register watchdog misc device (error code %d)\n", ret );
+	/*--- the selected Z069 device instance serves /dev/watchdog ---*/
+	if ( unit->instance == device && z069_wdg_init(unit) ) {
+		z069_unit_unmap(unit);
 		goto out;
 	}
 
-	return ret;
+	mutex_lock(&G_unitListLock);
+	list_add_tail(&unit->node, &G_unitList);
+	mutex_unlock(&G_unitListLock);
+
+	return 0;
 out:
 	printk(KERN_ERR PFX "Unable to register driver, z069_probe failed\n");
-	if(G_wdBase)
-		iounmap(G_wdBase);
-
-	if(memReq) {
-		if(G_ioMapped) {
-			release_region((unsigned long)chu->phys, (unsigned long)Z069_REG_SIZE);
-		} else {
-			release_mem_region((unsigned long)chu->phys, (unsigned long)Z069_REG_SIZE);
-		}
-	}
+	kfree(unit);
 	return -ENODEV;
 }
 
 static int z069_remove(CHAMELEON_UNIT_T *chu)
 {
+	Z069_UNIT *unit, *found = NULL;
+
 	Z069DBG("z069_remove\n");
-	misc_deregister(&z069_watchdog_miscdev);
-	if(G_ioMapped) {
-		release_region( (unsigned long)chu->phys, (unsigned long)Z069_REG_SIZE);
-	} else {
-		iounmap(G_wdBase);
-		release_mem_region((unsigned long)chu->phys, (unsigned long)Z069_REG_SIZE);
+
+	mutex_lock(&G_unitListLock);
+	list_for_each_entry(unit, &G_unitList, node) {
+		if(unit->chu == chu) {
+			found = unit;
+			list_del(&unit->node);
+			break;
+		}
 	}
+	mutex_unlock(&G_unitListLock);
+
+	if(!found)
+		return 0;
+
+	if(found == G_wdUnit)
+		z069_wdg_exit();
+
+	/* handles held by kernel clients see -ENODEV from now on */
+	down(&found->lock);
+	z069_unit_unmap(found);
+	up(&found->lock);
+
+	kref_put(&found->ref, z069_unit_release);
 	return 0;
 }
 
 /* module stuff */
 static int __init z069_init(void)
 {
+	sema_init(&G_openSem, 1);
 	men_chameleon_register_driver( &G_driver );
 	return 0;
 }
@@ -47,6 +47,18 @@
 
 #define MEN_PROC_ROOT_DIR "men"		/**< root dir in /proc for LED controller */
 
+/* audit ring events */
+#define Z069_AUDIT_TRIGGER	1	/**< hardware trigger, value: WVR written */
+#define Z069_AUDIT_LOAD		2	/**< timer load, value: counts (0 = off) */
+#define Z069_AUDIT_OPEN		3	/**< /dev/watchdog opened */
+#define Z069_AUDIT_RELEASE	4	/**< /dev/watchdog closed, value: magic close */
+#define Z069_AUDIT_SET_MASK	5	/**< RMR written, value: mask */
+#define Z069_AUDIT_SET_CAUSE	6	/**< RCR written, value: written bits */
+#define Z069_AUDIT_SET_REQUEST	7	/**< RRR written, value: request */
+#define Z069_AUDIT_SYNC_RESET	8	/**< sync reset, value: deadline counts */
+#define Z069_AUDIT_ATTACH	9	/**< kernel client attached, value: counts */
+#define Z069_AUDIT_DETACH	10	/**< kernel client detached */
+
 #ifdef MAC_BYTESWAP
 #	define RSWAP8(a)	(a)
 #	define RSWAP16(a)	GALADR_Swap16(a)
@@ -101,6 +113,44 @@ typedef struct {
 	struct proc_dir_entry *led3_hdl;
 } PROC_LED_HDL;
 
+/** audit ring header, followed by the records */
+typedef struct {
+	u32 magic;			/**< Z069_AUDIT_MAGIC */
+	u32 nrecs;			/**< number of records */
+	u32 recSize;			/**< sizeof(Z069_AUDIT_REC) */
+	u32 reserved;
+} Z069_AUDIT_HDR;
+
+/** audit ring record */
+typedef struct {
+	u64 timeNs;			/**< wall clock time */
+	u32 seq;			/**< sequence number, 0 = slot invalid */
+	u32 pid;			/**< caller, 0 in interrupt context */
+	s32 slackMs;			/**< time left before this event, S32_MAX = off */
+	u16 event;			/**< Z069_AUDIT_xxx */
+	u16 value;			/**< event specific */
+	char comm[16];			/**< caller's command name */
+} Z069_AUDIT_REC;
+
+/** per 16Z069 unit data */
+typedef struct {
+	struct list_head node;		/**< entry in list of probed units */
+	struct kref ref;		/**< driver + z069_RstGet() references */
+	struct semaphore lock;		/**< serializes RCR/RMR/RRR/WTR accesses */
+	CHAMELEON_UNIT_T *chu;		/**< chameleon unit */
+	struct pci_dev *pdev;		/**< FPGA the unit belongs to */
+	int instance;			/**< probe order index, see parameter device */
+	char *base;			/**< register base, NULL after removal */
+	u32 ioMapped;			/**< nonzero if unit is IO mapped */
+} Z069_UNIT;
+
+/** per kernel client data, one per z069_RstGet() */
+typedef struct {
+	Z069_RST_HANDLE hdl;		/**< method table handed out to the client */
+	Z069_UNIT *unit;		/**< referenced unit */
+	int wdgAttached;		/**< this client owns the watchdog */
+} Z069_CLIENT;
+
 /*--------------------------------------+
 |   EXTERNALS                           |
 +--------------------------------------*/
@@ -0,0 +1,118 @@
+#!/bin/sh
+#
+# Check that an armed 16Z069 watchdog does not disturb isolated CPUs
+#
+# usage: z069_hk_interference.sh [cpulist [seconds [ping_s]]]
+#
+#   cpulist  CPUs to watch, e.g. "2-3". Default: isolated CPUs, else
+#            nohz_full CPUs, from /sys/devices/system/cpu
+#   seconds  length of each sample phase (default 10)
+#   ping_s   ping interval while armed (default 0.1)
+#
+# Samples the local timer interrupts (LOC in /proc/interrupts) and the
+# timer softirqs (TIMER in /proc/softirqs) of the watched CPUs twice:
+# once with the watchdog closed and once while this script keeps it
+# armed and pinged from a housekeeping CPU. Fails if the armed phase
+# adds more than TOLERANCE (default 1) events per second on any watched
+# CPU. The watchdog is closed with the magic 'V' at the end, so the
+# driver must not be loaded with nowayout=1.
+#
+# Copyright 2019, MEN Mikro Elektronik GmbH
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+
+WDG=/dev/watchdog
+SYSFS=/sys/class/misc/watchdog
+CPUDIR=/sys/devices/system/cpu
+
+CPUS=$1
+SECS=${2:-10}
+PING=${3:-0.1}
+TOLERANCE=${TOLERANCE:-1}
+
+die() {
+	echo "$0: $*" >&2
+	exit 2
+}
+
+# expand a CPU list like "1,3-5" into "1 3 4 5"
+expand_cpus() {
+	echo "$1" | tr ',' '\n' | while IFS=- read -r first last; do
+		[ -n "$first" ] || continue
+		seq "$first" "${last:-$first}"
+	done | tr '\n' ' '
+}
+
+# print "<cpu> <LOC> <TIMER>" for every online CPU
+sample() {
+	{
+		awk '/^ *CPU/ { for(i = 1; i <= NF; i++) cpu[i] = substr($i, 4); next }
+		     $1 == "LOC:" { for(i = 2; (i - 1) in cpu; i++) print cpu[i - 1], "loc", $i }' /proc/interrupts
+		awk '/^ *CPU/ { for(i = 1; i <= NF; i++) cpu[i] = substr($i, 4); next }
+		     $1 == "TIMER:" { for(i = 2; (i - 1) in cpu; i++) print cpu[i - 1], "timer", $i }' /proc/softirqs
+	} | awk '{ v[$1, $2] = $3; c[$1] = 1 }
+	         END { for(n in c) print n, v[n, "loc"] + 0, v[n, "timer"] + 0 }'
+}
+
+# print "<cpu> <LOC/s> <TIMER/s>" of the watched CPUs between two samples
+rate() {
+	awk -v cpus=" $CPUS_EXP " -v secs="$SECS" '
+		NR == FNR { loc[$1] = $2; tim[$1] = $3; next }
+		index(cpus, " " $1 " ") { printf "%s %.1f %.1f\n", $1, ($2 - loc[$1]) / secs, ($3 - tim[$1]) / secs }' "$1" "$2"
+}
+
+[ -w "$WDG" ] || die "cannot write $WDG"
+[ -r "$SYSFS/housekeeping_cpus" ] || die "no 16Z069 watchdog at $SYSFS"
+
+if [ -z "$CPUS" ]; then
+	CPUS=$(cat "$CPUDIR/isolated" 2>/dev/null)
+	[ -n "$CPUS" ] || CPUS=$(cat "$CPUDIR/nohz_full" 2>/dev/null)
+	[ -n "$CPUS" ] && [ "$CPUS" != "(null)" ] || die "no isolated CPUs, pass a cpulist"
+fi
+CPUS_EXP=$(expand_cpus "$CPUS")
+HK_CPUS=$(cat "$SYSFS/housekeeping_cpus")
+HK_CPU=$(expand_cpus "$HK_CPUS" | awk '{ print $1 }')
+MISSES0=$(cat "$SYSFS/housekeeping_misses")
+
+TMP=$(mktemp -d) || die "cannot create temp dir"
+trap 'rm -rf "$TMP"' EXIT
+
+echo "watching CPUs $CPUS, housekeeping CPUs $HK_CPUS, ${SECS}s per phase"
+
+sample > "$TMP/idle0"
+sleep "$SECS"
+sample > "$TMP/idle1"
+
+taskset -c "$HK_CPU" sh -c '
+	exec 3>"$1"
+	end=$(( $(date +%s) + $2 ))
+	while [ "$(date +%s)" -lt "$end" ]; do
+		printf x >&3
+		sleep "$3"
+	done
+	printf V >&3
+' z069_ping "$WDG" "$((SECS + 2))" "$PING" &
+PINGER=$!
+sleep 1
+sample > "$TMP/armed0"
+sleep "$SECS"
+sample > "$TMP/armed1"
+wait "$PINGER" || die "pinging $WDG failed"
+
+rate "$TMP/idle0" "$TMP/idle1" > "$TMP/idle"
+rate "$TMP/armed0" "$TMP/armed1" > "$TMP/armed"
+
+echo "housekeeping_misses: +$(( $(cat "$SYSFS/housekeeping_misses") - MISSES0 ))"
+echo "cpu  LOC/s idle armed  TIMER/s idle armed"
+awk -v tol="$TOLERANCE" '
+	NR == FNR { loc[$1] = $2; tim[$1] = $3; next }
+	{
+		dl = $2 - loc[$1]; dt = $3 - tim[$1]
+		bad = (dl > tol || dt > tol)
+		printf "%-4s %10.1f %5.1f  %12.1f %5.1f  %s\n", $1, loc[$1], $2, tim[$1], $3, bad ? "FAIL" : "ok"
+		fail += bad
+	}
+	END { exit fail ? 1 : 0 }' "$TMP/idle" "$TMP/armed"
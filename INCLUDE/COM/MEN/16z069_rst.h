@@ -119,6 +119,12 @@ MMCHAM_16Z069RST* MMCHAM_16z069RstCreate( u_int32 busNo, u_int32 devNo );
 #define Z069_WDOG_FREQ		500	/**< timer counts at this frequency (HZ) */
 #define Z069WDOG_SHORT_TOUT 20	/**< timeout in WDOG_STATE_SHORT_TOUT (1/10s)*/
 
+/** argument of RSTIOC_SYNC_RESET */
+typedef struct {
+	u_int32 deadlineMs;	/**< watchdog deadline for sync and reset [ms] */
+	u_int32 request;	/**< value written to RRR after the sync */
+} Z069_SYNC_RESET;
+
 /* MEN specific IOCTL codes */
 #define	Z069_WDT_IOCTL_BASE	'M'
 
@@ -128,6 +134,7 @@ MMCHAM_16Z069RST* MMCHAM_16z069RstCreate( u_int32 busNo, u_int32 devNo );
 #define RSTIOC_GET_RESET_CAUSE      	_IOR(Z069_WDT_IOCTL_BASE, 4, int)
 #define RSTIOC_SET_RESET_REQUEST    	_IOW(Z069_WDT_IOCTL_BASE, 5, int)
 #define RSTIOC_GET_RESET_REQUEST    	_IOR(Z069_WDT_IOCTL_BASE, 6, int)
+#define RSTIOC_SYNC_RESET           	_IOW(Z069_WDT_IOCTL_BASE, 7, Z069_SYNC_RESET)
 
 #ifdef __cplusplus
 	}
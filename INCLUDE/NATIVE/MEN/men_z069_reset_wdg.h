@@ -44,6 +44,89 @@
 #define Z069_WDT_COUNTER_MIN 1                  /**< min. value of watchdog counter */
 #define Z069_WDT_TIMER_FREQUENZ (500)           /**< Timer frequency [Hz] of watchdog counter */
 
+/* register trace directions, see Z069_TRACE_REC */
+#define Z069_TRACE_READ		0	/**< value read from register */
+#define Z069_TRACE_WRITE	1	/**< value written to register */
+
+/*-----------------------------------------+
+|  TYPEDEFS                                |
++-----------------------------------------*/
+/**
+ * Binary register access trace record (24 bytes, native endianness)
+ *
+ * The driver writes one record per Z69READ_D16()/Z69WRITE_D16() while
+ * module parameter trace is set and trace_recs > 0. Records go to one
+ * relay file per CPU, debugfs men_z069_wdg/trace<cpu>. Each file can be
+ * mmap()ed (8 sub-buffers * trace_recs * 24 bytes) and is a ring of
+ * records without padding that is overwritten when full. poll() reports
+ * every sub-buffer switch. A consumer walks the ring in seq order: a
+ * record is valid once its seq is nonzero and equals the previous seq
+ * plus one; a jump in seq means records were overwritten.
+ *
+ * Replay: applying the records of all CPUs in time order to a register
+ * model reproduces the register traffic. Model semantics: RCR bits are
+ * cleared by writing 1, RMR/RRR/WTR hold the value written, WVR holds the
+ * last trigger value (a trigger writes the inverted value read before),
+ * WTR bit 15 enables the watchdog and bits 14..0 are the timeout in
+ * 2 ms counts.
+ */
+typedef struct {
+	u_int32 timeSec;	/**< CLOCK_MONOTONIC seconds */
+	u_int32 timeNsec;	/**< CLOCK_MONOTONIC nanoseconds */
+	u_int32 seq;		/**< per CPU sequence number, 0 = invalid */
+	u_int32 pid;		/**< caller, 0 in interrupt context */
+	u_int16 offs;		/**< register offset, Z069_RST_xxx */
+	u_int16 value;		/**< value read or written */
+	u_int16 cpu;		/**< CPU the access ran on */
+	u_int8 dir;		/**< Z069_TRACE_READ/Z069_TRACE_WRITE */
+	u_int8 unit;		/**< unit instance (probe order) */
+} Z069_TRACE_REC;
+
+struct pci_dev;
+
+/* reset controller handle for other kernel drivers */
+typedef struct Z069_RST_HANDLE_S Z069_RST_HANDLE;
+
+struct Z069_RST_HANDLE_S
+{
+	/*---------------+
+	|  METHODS       |
+	+---------------*/
+    /**********************************************************************/
+    /** request reset (write RRR)
+	 */
+	int (*reset)( Z069_RST_HANDLE* this, u_int16 mask );
+    /**********************************************************************/
+    /** get reset cause (bitmask), optionally clear it
+	 */
+	int (*getResetCause)( Z069_RST_HANDLE* this, u_int16 *causeP, int clearRstCause );
+    /**********************************************************************/
+    /** set/get reset mask (RMR)
+	 */
+	int (*setResetMask)( Z069_RST_HANDLE* this, u_int16 mask );
+	int (*getResetMask)( Z069_RST_HANDLE* this, u_int16 *maskP );
+	/**********************************************************************/
+	/**	take over the watchdog, timeout in 1/100s (0 = default).
+	 *  Fails with -EBUSY while /dev/watchdog is open or another
+	 *  handle is attached.
+	 */
+	int (*attachWdog)( Z069_RST_HANDLE* this, int timeout );
+	/**********************************************************************/
+	/**	trigger the watchdog attached through this handle
+	 */
+	int (*triggerWdog)( Z069_RST_HANDLE* this );
+	/**********************************************************************/
+	/**	stop and release the watchdog, if attached through this handle
+	 */
+	void (*detachWdog)( Z069_RST_HANDLE* this );
+};
+
+/*-----------------------------------------+
+|  PROTOTYPS                               |
++-----------------------------------------*/
+Z069_RST_HANDLE* z069_RstGet( struct pci_dev *pdev, int instance );
+void z069_RstPut( Z069_RST_HANDLE **hdlP );
+
 int z069_SetResetMask( u_int32 );
 int z069_GetResetMask( u_int32 * );
 int z069_SetResetCause( u_int32 );